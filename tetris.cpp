@@ -10,26 +10,69 @@ How to use:
     g++ -std=c++17 -O2 tetris.cpp -o tetris
     ./tetris
 
+Options:
+ - --preview N : number of upcoming pieces shown (0..12, default 5)
+ - --seed S    : randomizer seed (same seed, same piece sequence)
+ - --color MODE: none, 256 or truecolor (default: truecolor if $COLORTERM says so, 256 if $TERM does, else none)
+ - --blocks half|quad: pack 2 (stacked) or 4 (2x2) board cells per character with Unicode block glyphs
+ - --scores FILE : high-score log, with its sorted index in FILE.idx (default tetris.scores)
+ - --das F / --arr F : auto-shift delay and repeat, in 60 Hz frames (default 10 / 2; ARR 0 = instant to the wall)
+ - --save FILE : where 'q' saves the game and the next start resumes it (default tetris.sav)
+ - --stats FILE: append frame/input/tick/draw and key-to-screen latency percentiles every 10s and at exit
+ - --metrics ADDR / --metrics-file FILE: Prometheus text metrics over HTTP (Linux; a bare PORT binds 127.0.0.1) or rewritten to a file every 5s
+ - --record FILE: record the session as an asciinema v2 cast (asciinema play FILE; also the dashboard and --connect)
+ - --selftest  : check that saved snapshots round-trip and that damaged ones are refused, then exit
+ - --trace FILE: write engine spans as Chrome trace JSON at exit or on SIGUSR1 (build with -DTETRIS_TRACE)
+
+Versus over the network (Linux):
+ - --server ADDR            : host matches; players are paired as they connect
+ - --server ADDR --dashboard K : also tile K live games on the server's terminal (up to 16, refreshed at 10 Hz)
+ - --connect ADDR           : play against whoever the server pairs you with
+ - --connect ADDR --spectate SLOT : watch a player's game (-1 = any match in progress)
+ - --connect ADDR --loadtest N [--spectators M] [--duration S] : loopback bots, for load testing
+   ADDR is PORT, HOST:PORT or unix:PATH
+
 This is a terminal/console version that uses simple ANSI escape sequences to redraw the board.
 It provides its own small cross-platform non-blocking input layer using:
  - _kbhit()/_getch() on Windows
- - termios + select on POSIX
+ - termios + one non-blocking read per frame on POSIX, decoded by an incremental escape-sequence parser
 
 Keys:
  - a / A / <- : move left
  - d / D / -> : move right
  - s / S / down arrow : soft drop
  - w / W / up arrow : rotate clockwise
+ - z / Z : rotate counter-clockwise
  - space : hard drop
+ - c : hold piece
+ - g : toggle ghost piece
+ - f : toggle the frame timing overlay
  - p : pause
- - q : quit
+ - q : quit (the game is saved and resumed on the next start)
 
 Features:
  - Standard 7 tetrominoes
- - Rotation (simple 4x4 matrix rotation)
+ - Super Rotation System (SRS) rotation with wall kicks
  - Line clearing, scoring, and level progression
- - Next piece preview
- - Simple game loop with gravity and input handling
+ - 7-bag randomizer, hold slot and multi-piece preview (--preview N, default 5)
+ - Ghost piece showing where the current piece will land
+ - Fixed 60 Hz simulation ticks with gravity and input handling
+ - Rendering on its own thread fed by a lock-free triple buffer, so a slow terminal never stalls the game
+ - Diff rendering to a non-blocking stdout: only changed spans are sent, and a congested terminal skips frames
+ - 256-color and truecolor modes that send a color escape only where the color changes along a run
+ - Half- and quarter-block modes that fit 2 or 4 board cells in one character, glyphs picked from a mask table
+ - Layout recomputed only on terminal resize (SIGWINCH); output is clipped to the visible window
+ - Engine-side DAS/ARR auto-repeat, with key press/release from the kitty keyboard protocol when available
+ - Quit saves the game as a versioned binary snapshot; the next start resumes it
+ - High-score table: append-only log shared safely by concurrent processes, top-N index loaded with mmap
+ - Frame-time and key-to-screen latency histograms (overlay on 'f', periodic dump with --stats)
+ - Prometheus metrics (games, pieces, lines, score, frame time, bytes) from per-thread sharded counters
+ - Optional span tracing to Chrome trace JSON, compiled out unless built with -DTETRIS_TRACE
+ - Versus server: many games per process on one epoll loop, garbage lines sent between opponents
+ - Garbage queue with attack cancellation, combo/back-to-back/perfect-clear bonuses, O(rows) insertion
+ - Compact binary protocol: snapshots on join/resync, then piece moves and locks as small deltas
+ - Client-side prediction with rollback to the server-confirmed state
+ - Spectators served from one shared, encode-once update stream per game
 
 Notes & limitations:
  - Terminal must support ANSI escape codes (most modern terminals do).
@@ -44,15 +87,132 @@ Enjoy! If you want a graphical version (SDL2/SFML/SDL), tell me and I can provid
 #include <conio.h>
 #include <thread>      // ✅ correct place
 #include <windows.h>
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
 #else
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <signal.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
 #endif
 
 using namespace std;
 
+// Tracing
+// Build with -DTETRIS_TRACE and run with --trace FILE to record spans (input,
+// gravity, lock, line clear, spawn, render, server tick) and write them as
+// Chrome trace JSON, viewable in chrome://tracing or ui.perfetto.dev, at exit
+// or on SIGUSR1. Each thread records into its own fixed ring, which only that
+// thread writes, so recording takes no lock; when full the oldest spans are
+// overwritten. Without TETRIS_TRACE the macros expand to nothing.
+#ifdef TETRIS_TRACE
+struct TraceEvent{
+    const char *name;
+    int64_t start, dur; // ns since the first trace timestamp
+};
+
+const uint32_t TRACE_CAP = 1 << 16; // spans kept per thread, power of two
+
+struct TraceRing{
+    array<TraceEvent,TRACE_CAP> ev;
+    atomic<uint32_t> written{0}; // spans ever recorded; the slot is written & (TRACE_CAP-1)
+    int tid = 0;
+    TraceRing *next = nullptr;
+};
+
+atomic<TraceRing*> traceRings{nullptr}; // every thread's ring, pushed on first use
+atomic<int> traceThreads{0};
+string tracePath;
+volatile sig_atomic_t traceDumpWanted = 0;
+
+int64_t traceNow(){
+    static const auto t0 = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+}
+
+TraceRing &traceRing(){
+    // rings are never freed: the exporter may read one after its thread ends
+    thread_local TraceRing *ring = nullptr;
+    if(!ring){
+        ring = new TraceRing();
+        ring->tid = ++traceThreads;
+        ring->next = traceRings.load();
+        while(!traceRings.compare_exchange_weak(ring->next, ring)){}
+    }
+    return *ring;
+}
+
+struct TraceSpan{
+    const char *name;
+    int64_t start;
+    explicit TraceSpan(const char *n) : name(n), start(traceNow()) {}
+    ~TraceSpan(){
+        TraceRing &r = traceRing();
+        uint32_t i = r.written.load(memory_order_relaxed);
+        r.ev[i & (TRACE_CAP-1)] = {name, start, traceNow() - start};
+        r.written.store(i + 1, memory_order_release);
+    }
+};
+
+void traceWrite(){
+    if(tracePath.empty()) return;
+    FILE *f = fopen(tracePath.c_str(), "w");
+    if(!f) return;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", f);
+    bool first = true;
+    vector<TraceEvent> copy;
+    for(TraceRing *r = traceRings.load(); r; r = r->next){
+        uint32_t end = r->written.load(memory_order_acquire);
+        uint32_t begin = end > TRACE_CAP ? end - TRACE_CAP : 0;
+        copy.clear();
+        for(uint32_t i=begin;i<end;++i) copy.push_back(r->ev[i & (TRACE_CAP-1)]);
+        // drop slots the owning thread may have overwritten while we copied,
+        // plus slot `after`, which it may be writing right now
+        uint32_t after = r->written.load(memory_order_acquire);
+        size_t skip = after - begin >= TRACE_CAP ? min<size_t>(copy.size(), after - begin - TRACE_CAP + 1) : 0;
+        for(size_t i=skip;i<copy.size();++i){
+            const TraceEvent &e = copy[i];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",\n", e.name, r->tid, e.start / 1000.0, e.dur / 1000.0);
+            first = false;
+        }
+    }
+    fputs("\n]}\n", f);
+    fclose(f);
+}
+
+void traceOnSignal(int){ traceDumpWanted = 1; }
+
+// Called from the main loops: writes the trace when SIGUSR1 asked for it.
+void tracePoll(){
+    if(!traceDumpWanted) return;
+    traceDumpWanted = 0;
+    traceWrite();
+}
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name)
+#define TRACE_POLL() tracePoll()
+#else
+#define TRACE_SPAN(name)
+#define TRACE_POLL()
+#endif
+
 // Board size
 const int BOARD_W = 10;
 const int BOARD_H = 20;
@@ -120,44 +280,174 @@ void initPieces(){
                 p.cells[r][c] = (shape[r][c]=='X')?1:0;
             }
         }
-        // put into 4x4 grid (top-left)
-        Piece out{}; out.size = 4;
-        for(int r=0;r<4;++r) for(int c=0;c<4;++c) out.cells[r][c]=0;
-        for(int r=0;r<p.size;++r) for(int c=0;c<p.size;++c) out.cells[r][c]=p.cells[r][c];
-        return out;
+        // stays in the top-left of the 4x4 grid; size keeps the SRS bounding box
+        return p;
     };
     for(auto &s:TETROMINO) pieces.push_back(toPiece(s));
 }
 
-// Rotate 4x4 piece clockwise times (0..3)
+// Rotate piece clockwise times (0..3) inside its own size x size box, which is
+// the SRS "true rotation" about the box centre
 Piece rotatePiece(const Piece &p, int times){
     Piece cur = p;
+    int n = p.size;
     times = (times%4+4)%4;
     while(times--){
-        Piece nw{}; nw.size = 4;
-        for(int r=0;r<4;++r) for(int c=0;c<4;++c) nw.cells[r][c] = cur.cells[3-c][r];
+        Piece nw{}; nw.size = n;
+        for(int r=0;r<n;++r) for(int c=0;c<n;++c) nw.cells[r][c] = cur.cells[n-1-c][r];
         cur = nw;
     }
     return cur;
 }
 
+// One bit per board column (bit c = column c); the board keeps one per row.
+typedef uint64_t RowBits;
+static_assert(BOARD_W <= 60, "board rows must fit in RowBits");
+const RowBits FULL_ROW = (RowBits(1) << BOARD_W) - 1;
+
+// Every piece in every rotation, built once by initOriented() so the hot paths
+// (collision, placement, hard drop, drawing) never rotate a matrix.
+struct Oriented{
+    Piece p;
+    array<int,4> bottom; // lowest filled row in each column of the 4x4 box, -1 if empty
+    array<RowBits,4> rows; // cells of each row as column bits
+};
+
+vector<array<Oriented,4>> oriented;
+
+void initOriented(){
+    oriented.assign(pieces.size(), {});
+    for(size_t id=0; id<pieces.size(); ++id) for(int rot=0; rot<4; ++rot){
+        Oriented &o = oriented[id][rot];
+        o.p = rotatePiece(pieces[id], rot);
+        for(int c=0;c<4;++c){
+            o.bottom[c] = -1;
+            for(int r=3;r>=0;--r) if(o.p.cells[r][c]){ o.bottom[c] = r; break; }
+        }
+        for(int r=0;r<4;++r){
+            o.rows[r] = 0;
+            for(int c=0;c<4;++c) if(o.p.cells[r][c]) o.rows[r] |= RowBits(1) << c;
+        }
+    }
+}
+
+// SRS wall kicks, indexed [from rotation][0 = clockwise, 1 = counter-clockwise],
+// as (dx, dy) with y pointing up like the guideline tables. Rotation states are
+// 0 = spawn, 1 = R, 2 = 2, 3 = L. O never kicks.
+struct Kick{ int8_t dx, dy; };
+
+constexpr Kick KICKS_JLSTZ[4][2][5] = {
+    {{{0,0},{-1,0},{-1,+1},{0,-2},{-1,-2}},   // 0->R
+     {{0,0},{+1,0},{+1,+1},{0,-2},{+1,-2}}},  // 0->L
+    {{{0,0},{+1,0},{+1,-1},{0,+2},{+1,+2}},   // R->2
+     {{0,0},{+1,0},{+1,-1},{0,+2},{+1,+2}}},  // R->0
+    {{{0,0},{+1,0},{+1,+1},{0,-2},{+1,-2}},   // 2->L
+     {{0,0},{-1,0},{-1,+1},{0,-2},{-1,-2}}},  // 2->R
+    {{{0,0},{-1,0},{-1,-1},{0,+2},{-1,+2}},   // L->0
+     {{0,0},{-1,0},{-1,-1},{0,+2},{-1,+2}}}   // L->2
+};
+
+constexpr Kick KICKS_I[4][2][5] = {
+    {{{0,0},{-2,0},{+1,0},{-2,-1},{+1,+2}},   // 0->R
+     {{0,0},{-1,0},{+2,0},{-1,+2},{+2,-1}}},  // 0->L
+    {{{0,0},{-1,0},{+2,0},{-1,+2},{+2,-1}},   // R->2
+     {{0,0},{+2,0},{-1,0},{+2,+1},{-1,-2}}},  // R->0
+    {{{0,0},{+2,0},{-1,0},{+2,+1},{-1,-2}},   // 2->L
+     {{0,0},{+1,0},{-2,0},{+1,-2},{-2,+1}}},  // 2->R
+    {{{0,0},{+1,0},{-2,0},{+1,-2},{-2,+1}},   // L->0
+     {{0,0},{-2,0},{+1,0},{-2,-1},{+1,+2}}}   // L->2
+};
+
+const int PIECE_I = 0, PIECE_O = 3;
+
 // Terminal control
 void clearScreen(){
 #ifdef _WIN32
-    // Using WinAPI to avoid flicker
+    // Using WinAPI to avoid flicker. Only the visible window is cleared: the
+    // buffer behind it can hold thousands of lines of scrollback.
     HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
     CONSOLE_SCREEN_BUFFER_INFO csbi;
     GetConsoleScreenBufferInfo(h, &csbi);
-    DWORD cells = csbi.dwSize.X * csbi.dwSize.Y;
-    COORD home = {0,0};
-    DWORD written;
-    FillConsoleOutputCharacter(h,' ',cells,home,&written);
+    const SMALL_RECT &w = csbi.srWindow;
+    DWORD width = w.Right - w.Left + 1, written;
+    for(SHORT y=w.Top; y<=w.Bottom; ++y){
+        COORD at = {w.Left, y};
+        FillConsoleOutputCharacter(h,' ',width,at,&written);
+        FillConsoleOutputAttribute(h,csbi.wAttributes,width,at,&written);
+    }
+    COORD home = {w.Left, w.Top};
     SetConsoleCursorPosition(h,home);
 #else
     cout << "\x1b[2J\x1b[H"; // clear and home
 #endif
 }
 
+// Visible window size in character cells (80x24 when it cannot be read).
+void terminalSize(int &rows, int &cols){
+    rows = 24; cols = 80;
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    if(GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)){
+        rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+        cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    }
+#else
+    winsize ws{};
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col){ rows = ws.ws_row; cols = ws.ws_col; }
+#endif
+}
+
+// Resizes. POSIX terminals raise SIGWINCH and the handler only sets a flag;
+// the Windows console has no signal, so there the window size is compared at
+// most twice a second. Either way a layout is computed again only after the
+// window really changed.
+volatile sig_atomic_t resizePending = 1; // first check always lays out
+
+#ifndef _WIN32
+void onResize(int){ resizePending = 1; }
+#endif
+
+void watchResize(){
+#ifndef _WIN32
+    struct sigaction sa{};
+    sa.sa_handler = onResize;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, nullptr);
+#endif
+}
+
+// Block or unblock SIGWINCH for the calling thread (and threads it starts
+// later). main() blocks it first, and only the thread that sleeps waiting for
+// input takes it back, so a resize always interrupts that wait.
+void deliverResize(bool deliver){
+#ifndef _WIN32
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGWINCH);
+    pthread_sigmask(deliver ? SIG_UNBLOCK : SIG_BLOCK, &set, nullptr);
+#else
+    (void)deliver;
+#endif
+}
+
+// True once per resize (and on the first call).
+bool takeResize(){
+#ifdef _WIN32
+    static int64_t nextCheck = 0;
+    static int lastRows = -1, lastCols = -1;
+    int64_t now = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    if(now >= nextCheck){
+        nextCheck = now + 500;
+        int rows, cols;
+        terminalSize(rows, cols);
+        if(rows != lastRows || cols != lastCols){ lastRows = rows; lastCols = cols; resizePending = 1; }
+    }
+#endif
+    if(!resizePending) return false;
+    resizePending = 0;
+    return true;
+}
+
 void hideCursor(){
 #ifdef _WIN32
     HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -182,6 +472,11 @@ void showCursor(){
 }
 
 // Cross-platform non-blocking keyboard
+// Kitty keyboard protocol (see the input decoder below): report every key as
+// an escape code with press/release, and ask whether the terminal supports it.
+const char *KITTY_ENABLE = "\x1b[>11u\x1b[?u";
+const char *KITTY_DISABLE = "\x1b[<u";
+
 void initTerminal(){
 #ifndef _WIN32
     // make stdin non-blocking and disable echo
@@ -191,10 +486,18 @@ void initTerminal(){
     tcsetattr(STDIN_FILENO, TCSANOW, &t);
     int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    cout << KITTY_ENABLE << flush; // ignored by terminals without the protocol
+#else
+    // the diff renderer positions the cursor with escape sequences
+    HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode;
+    if(GetConsoleMode(h, &mode)) SetConsoleMode(h, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    SetConsoleOutputCP(CP_UTF8); // block glyphs (--blocks) are sent as UTF-8
 #endif
 }
 void restoreTerminal(){
 #ifndef _WIN32
+    cout << KITTY_DISABLE << flush;
     termios t;
     tcgetattr(STDIN_FILENO, &t);
     t.c_lflag |= (ICANON | ECHO);
@@ -205,246 +508,3372 @@ void restoreTerminal(){
 #endif
 }
 
-int kbHit(){
+// Keyboard input. Each wakeup reads whatever is waiting with one read into a
+// byte ring; an incremental decoder turns those bytes into key events. The
+// decoder keeps its state between reads, so an escape sequence split across
+// two reads still decodes as one key.
+//
+// Terminals that speak the kitty keyboard protocol are switched to reporting
+// every key as an escape code with its event type, which gives real press and
+// release events (terminal auto-repeats are dropped; the engine repeats keys
+// itself, see AutoShift). Elsewhere keys arrive as plain bytes, presses only.
+enum Key { KEY_ESC = 27, KEY_UP = 0x100, KEY_DOWN, KEY_RIGHT, KEY_LEFT };
+const int KEY_RELEASE = 1 << 20; // or'ed into a key: it was let go
+
+const uint32_t INPUT_RING = 256; // bytes, power of two
+const uint32_t KEY_QUEUE = 64;   // decoded events, power of two
+const int64_t ESC_TIMEOUT_MS = 50; // a lone ESC is the Esc key once nothing follows
+
+struct InputDecoder{
+    array<uint8_t,INPUT_RING> bytes{};
+    uint32_t head = 0, tail = 0;       // undecoded bytes
+    array<int,KEY_QUEUE> keys{};
+    uint32_t keyHead = 0, keyTail = 0; // decoded events
+    enum State { GROUND, ESC, CSI, SS3, WIN_PREFIX } state = GROUND;
+    array<int,4> params{}, subs{};     // numeric CSI parameters and the first ':' sub-parameter of each
+    int nparams = 0, nsub = 0;         // nsub: ':' seen in the current parameter
+    int prefix = 0;                    // private marker ('<' '=' '>' '?') opening the CSI
+    int64_t escAt = 0;
+    bool polled = false;               // read once since the queue last ran dry
+    bool kitty = false;                // the terminal answered the kitty protocol query
+};
+
+InputDecoder input;
+
+int64_t inputNowMs(){
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void pushKey(int k){ input.keys[input.keyTail++ & (KEY_QUEUE-1)] = k; }
+
+// Key for a CSI sequence's final byte, or -1 for ones the game ignores.
+int csiKey(int final){
+    switch(final){
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        default: return -1;
+    }
+}
+
+// A complete CSI sequence: an arrow (legacy or kitty form), a kitty
+// "CSI code;mods:event u" key, or the answer to the kitty support query.
+void csiEvent(int final){
+    InputDecoder &in = input;
+    if(in.prefix){
+        if(in.prefix == '?' && final == 'u') in.kitty = true;
+        return;
+    }
+    int key = -1;
+    if(final == 'u'){
+        int code = in.params[0];
+        int mods = max(in.params[1], 1) - 1;
+        if(code == 13 || code == 9 || code == 27 || code == 127 || (code >= 32 && code < 127)) key = code;
+        if(key >= 0 && (mods & 4) && isalpha(key)) key &= 0x1F; // ctrl+letter, as the legacy byte
+    } else key = csiKey(final);
+    if(key < 0) return;
+    int event = in.subs[1]; // kitty: 1 press (or absent), 2 repeat, 3 release
+    if(event == 2) return;
+    pushKey(event == 3 ? key | KEY_RELEASE : key);
+}
+
+// Decode buffered bytes into events while the queue has room for them (an
+// ESC followed by another key can produce two).
+void decodeInput(int64_t nowMs){
+    InputDecoder &in = input;
+    while(in.head != in.tail && in.keyTail - in.keyHead <= KEY_QUEUE - 2){
+        uint8_t b = in.bytes[in.head++ & (INPUT_RING-1)];
+        switch(in.state){
+        case InputDecoder::GROUND:
+            if(b == 27){ in.state = InputDecoder::ESC; in.escAt = nowMs; }
+#ifdef _WIN32
+            else if(b == 0 || b == 0xE0) in.state = InputDecoder::WIN_PREFIX; // _getch() extended key
+#endif
+            else pushKey(b);
+            break;
+        case InputDecoder::ESC:
+            if(b == '['){
+                in.state = InputDecoder::CSI;
+                in.params.fill(0); in.subs.fill(0);
+                in.nparams = 1; in.nsub = 0; in.prefix = 0;
+            } else if(b == 'O') in.state = InputDecoder::SS3;
+            else if(b == 27){ pushKey(KEY_ESC); in.escAt = nowMs; }
+            else { pushKey(KEY_ESC); pushKey(b); in.state = InputDecoder::GROUND; }
+            break;
+        case InputDecoder::CSI:
+            if(b >= '0' && b <= '9'){
+                int &p = in.nsub == 0 ? in.params[in.nparams-1] : in.subs[in.nparams-1];
+                if(in.nsub <= 1) p = min(p*10 + (b - '0'), 99999);
+            } else if(b == ';'){
+                if(in.nparams < (int)in.params.size()) in.nparams++;
+                in.nsub = 0;
+            } else if(b == ':') in.nsub++;
+            else if(b >= '<' && b <= '?') in.prefix = b;
+            else if(b >= 0x40 && b <= 0x7E){ // final byte
+                csiEvent(b);
+                in.state = InputDecoder::GROUND;
+            } else if(b < 0x20 || b > 0x3F) in.state = InputDecoder::GROUND; // malformed: drop it
+            break;
+        case InputDecoder::SS3: { // ESC O A..D: arrows in application cursor mode
+            int k = csiKey(b);
+            if(k >= 0) pushKey(k);
+            in.state = InputDecoder::GROUND;
+            break;
+        }
+        case InputDecoder::WIN_PREFIX:
+            if(b == 72) pushKey(KEY_UP);
+            else if(b == 80) pushKey(KEY_DOWN);
+            else if(b == 77) pushKey(KEY_RIGHT);
+            else if(b == 75) pushKey(KEY_LEFT);
+            in.state = InputDecoder::GROUND;
+            break;
+        }
+    }
+}
+
+// Move whatever input is waiting into the byte ring: one readv() on POSIX.
+void fillInput(){
+    InputDecoder &in = input;
+    uint32_t space = INPUT_RING - (in.tail - in.head);
+    if(!space) return;
 #ifdef _WIN32
-    return _kbhit();
+    while(space-- && _kbhit()) in.bytes[in.tail++ & (INPUT_RING-1)] = (uint8_t)_getch();
 #else
-    fd_set set;
-    struct timeval tv;
-    FD_ZERO(&set);
-    FD_SET(STDIN_FILENO, &set);
-    tv.tv_sec = 0; tv.tv_usec = 0;
-    return select(STDIN_FILENO+1, &set, NULL, NULL, &tv) > 0;
+    uint32_t at = in.tail & (INPUT_RING-1);
+    uint32_t first = min(space, INPUT_RING - at);
+    iovec iov[2] = {{&in.bytes[at], first}, {&in.bytes[0], space - first}};
+    ssize_t n = readv(STDIN_FILENO, iov, space > first ? 2 : 1);
+    if(n > 0) in.tail += n;
 #endif
 }
 
-int getChNonBlocking(){
+// Sleep until stdin has bytes, a signal arrives or timeoutMs passes (-1: no
+// limit). The idle policy: loops block here instead of waking on a timer.
+void waitInput(int timeoutMs){
 #ifdef _WIN32
-    if(_kbhit()) return _getch();
-    return -1;
+    WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), timeoutMs < 0 ? INFINITE : (DWORD)timeoutMs);
 #else
-    int c = getchar();
-    if(c==EOF) return -1;
-    return c;
+    pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    poll(&pfd, 1, timeoutMs);
 #endif
 }
 
+// Timeout the decoder needs to resolve a lone ESC, or -1.
+int inputTimeout(){ return input.state == InputDecoder::ESC ? (int)ESC_TIMEOUT_MS : -1; }
+
+// Column heights and hole count, kept up to date by placePiece()/clearLines()
+// so callers never have to rescan the board.
+struct Surface{
+    array<int,BOARD_W> height{}; // filled height of each column (0 = empty)
+    array<int,BOARD_W> filled{}; // number of filled cells in each column
+    int maxHeight = 0;
+    int holes = 0;               // empty cells below the top of their column
+};
+
+// Piece randomizer: a small splitmix64 generator whose state lives in Game, so
+// a game is reproducible from its seed.
+uint64_t nextRandom(uint64_t &state){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Upcoming pieces in a fixed-capacity ring, refilled a whole 7-bag at a time
+// so spawning is a pop and the preview is read in place.
+const int QUEUE_CAP = 32;   // power of two
+const int MAX_PREVIEW = 12; // the queue always holds more than this many pieces
+
+struct PieceQueue{
+    array<uint8_t,QUEUE_CAP> ids{};
+    uint32_t head = 0, count = 0;
+
+    int peek(int i) const { return ids[(head+i) & (QUEUE_CAP-1)]; }
+    int pop(){ count--; return ids[head++ & (QUEUE_CAP-1)]; }
+    void push(int id){ ids[(head+count++) & (QUEUE_CAP-1)] = (uint8_t)id; }
+};
+
+// What the last lock did, so observers (the versus server) can describe it
+// to clients as an event instead of re-sending the board.
+struct LockInfo{
+    int8_t id = 0, rot = 0, x = 0, y = 0; // where the piece came to rest
+    uint32_t clearedMask = 0;             // bit r set for each row cleared
+    uint8_t garbageBatches = 0;           // garbage batches that rose after it
+    array<uint8_t,4> garbageRows{}, garbageHole{};
+};
+
+// Incoming garbage, one batch per attack received, oldest first. Each batch
+// keeps the hole column it was given when it arrived; outgoing attacks cancel
+// from the front.
+const int GARBAGE_CAP = 16; // power of two
+
+struct GarbageQueue{
+    array<uint8_t,GARBAGE_CAP> rows{}, hole{};
+    uint8_t head = 0, count = 0;
+    int total = 0; // rows over all batches
+
+    int slot(int i) const { return (head+i) & (GARBAGE_CAP-1); }
+    void push(int n, int h){
+        if(count==GARBAGE_CAP){ // full: fold into the newest batch
+            int s = slot(count-1);
+            rows[s] = (uint8_t)min(rows[s]+n, 255);
+        } else {
+            int s = slot(count++);
+            rows[s] = (uint8_t)n; hole[s] = (uint8_t)h;
+        }
+        total = min(total+n, 255*GARBAGE_CAP);
+    }
+    void pop(){ total -= rows[head]; head = slot(1); count--; }
+    // Cancel up to n rows from the oldest batches; returns what is left of n.
+    int cancel(int n){
+        while(n>0 && count){
+            int take = min(n, (int)rows[head]);
+            rows[head] -= take; total -= take; n -= take;
+            if(!rows[head]) pop();
+        }
+        return n;
+    }
+};
+
+static_assert(BOARD_H <= 32, "cleared-row masks are 32 bits");
+
 // Game state
+// Everything a game needs lives inline (no heap), so a server can keep
+// thousands of them in one contiguous array and copying one is a memcpy.
 struct Game{
-    vector<vector<int>> board; // 0 empty, >0 filled piece id
+    // The board is a ring of rows: logical row r (0 = top) lives in slot
+    // (base + r) % BOARD_H, so garbage rises by moving base instead of
+    // shifting every row. Always go through cells()/bits().
+    array<array<uint8_t,BOARD_W>,BOARD_H> ringCells{}; // 0 empty, >0 filled piece id
+    array<RowBits,BOARD_H> ringBits{}; // filled cells of each row, kept in sync with ringCells
+    int base = 0;
+    Surface surf;
     int curPieceId;
     int curRot; // 0..3
     int curX, curY; // position of top-left of 4x4 block relative to board (x: col, y: row)
-    int nextPieceId;
+    int ghostY = 0; // row the current piece would land on (see updateGhost)
+    PieceQueue queue;
+    uint64_t rng = 0;
+    int holdId = -1;     // -1 = hold slot empty
+    bool canHold = true; // one hold per piece
+    int fallTimer = 0;   // ticks since the piece last fell
+    GarbageQueue garbage; // rows waiting to rise at the next lock that clears nothing
+    int combo = -1;       // consecutive clearing locks minus one (-1 = none)
+    bool b2b = false;     // last clear was a tetris
+    int attackOut = 0;   // rows sent by line clears, collected by the versus server
     bool gameOver = false;
     long long score = 0;
     int level = 1;
     int linesCleared = 0;
+    uint32_t pieces = 0; // pieces locked so far
+    LockInfo lastLock;
+
+    const Surface &surface() const { return surf; }
+    int slot(int r) const { int p = base + r; return p >= BOARD_H ? p - BOARD_H : p; }
+    array<uint8_t,BOARD_W> &cells(int r){ return ringCells[slot(r)]; }
+    const array<uint8_t,BOARD_W> &cells(int r) const { return ringCells[slot(r)]; }
+    RowBits &bits(int r){ return ringBits[slot(r)]; }
+    RowBits bits(int r) const { return ringBits[slot(r)]; }
 };
 
+static_assert(is_trivially_copyable<Game>::value, "Game copies must stay a memcpy (rollback, snapshots)");
+
 // Utilities
 bool collides(const Game &g, int pieceId, int rot, int x, int y){
-    Piece p = rotatePiece(pieces[pieceId], rot);
-    for(int r=0;r<4;++r) for(int c=0;c<4;++c){
-        if(!p.cells[r][c]) continue;
+    const Oriented &o = oriented[pieceId][rot];
+    for(int r=0;r<4;++r){
+        RowBits m = o.rows[r];
+        if(!m) continue;
         int br = y + r;
-        int bc = x + c;
-        if(bc < 0 || bc >= BOARD_W || br >= BOARD_H) return true; // out of bounds
-        if(br >=0 && g.board[br][bc]) return true; // hit filled cell
+        if(br >= BOARD_H) return true; // below the floor
+        if(x < 0){
+            if(m & ((RowBits(1) << -x) - 1)) return true; // past the left wall
+            m >>= -x;
+        } else m <<= x;
+        if(m & ~FULL_ROW) return true; // past the right wall
+        if(br >= 0 && (g.bits(br) & m)) return true; // hit filled cell
     }
     return false;
 }
 
 void placePiece(Game &g){
-    Piece p = rotatePiece(pieces[g.curPieceId], g.curRot);
+    const Piece &p = oriented[g.curPieceId][g.curRot].p;
     for(int r=0;r<4;++r) for(int c=0;c<4;++c){
         if(!p.cells[r][c]) continue;
         int br = g.curY + r;
         int bc = g.curX + c;
-        if(br>=0 && br<BOARD_H && bc>=0 && bc<BOARD_W) g.board[br][bc] = g.curPieceId+1; // store id+1
+        if(br>=0 && br<BOARD_H && bc>=0 && bc<BOARD_W){
+            g.cells(br)[bc] = g.curPieceId+1; // store id+1
+            g.bits(br) |= RowBits(1) << bc;
+            Surface &s = g.surf;
+            s.holes -= s.height[bc] - s.filled[bc];
+            s.filled[bc]++;
+            s.height[bc] = max(s.height[bc], BOARD_H - br);
+            s.holes += s.height[bc] - s.filled[bc];
+            s.maxHeight = max(s.maxHeight, s.height[bc]);
+        } else if(br < 0) g.gameOver = true; // locked out: part of the piece is above the board
     }
 }
 
-int clearLines(Game &g){
-    int cleared = 0;
+// Bit r set for each full row.
+uint32_t fullRows(const Game &g){
+    uint32_t mask = 0;
+    for(int r=0;r<BOARD_H;++r) if(g.bits(r)==FULL_ROW) mask |= 1u << r;
+    return mask;
+}
+
+// Remove the rows in mask in one bottom-up compaction pass, then update the
+// surface and score. Returns the number of rows removed.
+int removeRows(Game &g, uint32_t mask){
+    int cleared = __builtin_popcount(mask);
+    if(cleared==0) return 0;
+    int w = BOARD_H-1;
     for(int r=BOARD_H-1;r>=0;--r){
-        bool full = true;
-        for(int c=0;c<BOARD_W;++c) if(g.board[r][c]==0){ full=false; break; }
-        if(full){
-            cleared++;
-            // move everything above down
-            for(int rr=r; rr>0; --rr) g.board[rr] = g.board[rr-1];
-            g.board[0] = vector<int>(BOARD_W,0);
-            ++r; // re-check this row after shift
-        }
-    }
-    if(cleared>0){
-        // Scoring: classic Tetris: 1 line=40 * level, 2=100*level, 3=300*level, 4=1200*level (using SRS-like)
-        static int scoreTable[5] = {0,40,100,300,1200};
-        g.score += scoreTable[cleared] * g.level;
-        g.linesCleared += cleared;
-        g.level = 1 + g.linesCleared / 10; // level up every 10 lines
+        if(mask >> r & 1) continue;
+        if(w != r){ g.cells(w) = g.cells(r); g.bits(w) = g.bits(r); }
+        --w;
+    }
+    for(;w>=0;--w){ g.cells(w).fill(0); g.bits(w) = 0; }
+    // every cleared row was below the top of every column: drop each height by
+    // the cleared count, then walk down past any holes that are now exposed
+    Surface &s = g.surf;
+    s.maxHeight = 0; s.holes = 0;
+    for(int c=0;c<BOARD_W;++c){
+        int h = s.height[c] - cleared;
+        while(h>0 && !g.cells(BOARD_H-h)[c]) --h;
+        s.height[c] = h;
+        s.filled[c] -= cleared;
+        s.maxHeight = max(s.maxHeight, h);
+        s.holes += h - s.filled[c];
     }
+    // Scoring: classic Tetris: 1 line=40 * level, 2=100*level, 3=300*level, 4=1200*level (using SRS-like)
+    static int scoreTable[5] = {0,40,100,300,1200};
+    g.score += scoreTable[cleared] * g.level;
+    g.linesCleared += cleared;
+    g.level = 1 + g.linesCleared / 10; // level up every 10 lines
     return cleared;
 }
 
-void spawnPiece(Game &g){
-    g.curPieceId = g.nextPieceId;
-    g.nextPieceId = rand() % pieces.size();
+int clearLines(Game &g){
+    TRACE_SPAN("line clear");
+    uint32_t mask = fullRows(g);
+    g.lastLock.clearedMask = mask;
+    return removeRows(g, mask);
+}
+
+// Rows the current piece can fall before it lands: the piece's bottom profile
+// against the column heights, a handful of operations per column. Only a piece
+// tucked under an overhang needs to look at the board.
+int dropDistance(const Game &g){
+    const Oriented &o = oriented[g.curPieceId][g.curRot];
+    int dist = INT_MAX;
+    for(int c=0;c<4;++c){
+        int bottom = o.bottom[c];
+        if(bottom<0) continue;
+        int bc = g.curX + c;
+        int br = g.curY + bottom;
+        int top = BOARD_H - g.surf.height[bc]; // first filled row in this column
+        if(br < top) dist = min(dist, top - 1 - br);
+        else {
+            int rr = br + 1;
+            while(rr<BOARD_H && !g.cells(rr)[bc]) ++rr;
+            dist = min(dist, rr - 1 - br);
+        }
+    }
+    return dist;
+}
+
+void updateGhost(Game &g){
+    g.ghostY = g.curY + dropDistance(g);
+}
+
+// Push one shuffled bag of all seven pieces. A single 64-bit draw drives the
+// whole Fisher-Yates shuffle (7! permutations need under 13 bits).
+void refillQueue(Game &g){
+    while(g.queue.count <= MAX_PREVIEW){
+        uint64_t r = nextRandom(g.rng);
+        int bag[7] = {0,1,2,3,4,5,6};
+        for(int i=6;i>0;--i){
+            int j = (int)(r % (i+1));
+            r /= (i+1);
+            swap(bag[i], bag[j]);
+        }
+        for(int id : bag) g.queue.push(id);
+    }
+}
+
+// Put piece id at the spawn position.
+void startPiece(Game &g, int id){
+    g.curPieceId = id;
     g.curRot = 0;
-    g.curX = BOARD_W/2 - 2;
+    g.curX = BOARD_W/2 - (pieces[g.curPieceId].size+1)/2; // guideline spawn columns
     g.curY = -2; // allow spawn partly above board
     if(collides(g, g.curPieceId, g.curRot, g.curX, g.curY)){
         g.gameOver = true;
     }
+    updateGhost(g);
 }
 
-// Draw functions
-string pieceChar(int id){
-    static const char *ch = "@#%*+xo"; // up to 7
-    if(id<=0) return " ";
-    int idx = (id-1) % 7;
-    return string(1, ch[idx]);
-}
-
-void drawGame(const Game &g){
-    // Build a visual buffer
-    vector<string> out(BOARD_H, string(BOARD_W, ' '));
-    // copy board
-    for(int r=0;r<BOARD_H;++r) for(int c=0;c<BOARD_W;++c) if(g.board[r][c]) out[r][c] = pieceChar(g.board[r][c])[0];
-    // overlay current piece
-    Piece p = rotatePiece(pieces[g.curPieceId], g.curRot);
-    for(int r=0;r<4;++r) for(int c=0;c<4;++c){
-        if(!p.cells[r][c]) continue;
+void spawnPiece(Game &g){
+    TRACE_SPAN("spawn");
+    startPiece(g, g.queue.pop());
+    refillQueue(g);
+    g.canHold = true;
+}
+
+// Swap the current piece with the hold slot (or stash it and spawn the next
+// one when the slot is empty). Allowed once per piece.
+void holdPiece(Game &g){
+    if(!g.canHold) return;
+    int cur = g.curPieceId;
+    if(g.holdId < 0) spawnPiece(g);
+    else startPiece(g, g.holdId);
+    g.holdId = cur;
+    g.canHold = false;
+}
+
+void newGame(Game &g, uint64_t seed){
+    g = Game();
+    g.rng = seed;
+    refillQueue(g);
+    spawnPiece(g);
+}
+
+// Piece movement. The landing row only changes when the piece moves sideways,
+// rotates, or spawns onto a changed board, so the ghost is refreshed in exactly
+// those places and falling/drawing just reuse it.
+bool shiftPiece(Game &g, int dx){
+    if(collides(g, g.curPieceId, g.curRot, g.curX+dx, g.curY)) return false;
+    g.curX += dx;
+    updateGhost(g);
+    return true;
+}
+
+// Columns the current piece can slide in direction dir (-1 left, +1 right)
+// before it hits a wall or a block. Every piece row is one contiguous run, so
+// only its leading cell matters: the nearest blocker past it is one bit scan
+// on that board row. At most four rows, no stepping.
+int wallDistance(const Game &g, int dir){
+    const Oriented &o = oriented[g.curPieceId][g.curRot];
+    int dist = BOARD_W;
+    for(int r=0;r<4;++r){
+        RowBits m = o.rows[r];
+        if(!m) continue;
         int br = g.curY + r;
-        int bc = g.curX + c;
-        if(br>=0 && br<BOARD_H && bc>=0 && bc<BOARD_W) out[br][bc] = pieceChar(g.curPieceId+1)[0];
+        RowBits blockers = br >= 0 ? g.bits(br) : 0;
+        if(dir < 0){
+            int lead = __builtin_ctzll(m) + g.curX;
+            RowBits before = blockers & ((RowBits(1) << lead) - 1);
+            int stop = before ? 63 - __builtin_clzll(before) : -1;
+            dist = min(dist, lead - stop - 1);
+        } else {
+            int lead = 63 - __builtin_clzll(m) + g.curX;
+            RowBits after = blockers & ~((RowBits(2) << lead) - 1);
+            int stop = after ? __builtin_ctzll(after) : BOARD_W;
+            dist = min(dist, stop - lead - 1);
+        }
+    }
+    return dist;
+}
+
+void shiftToWall(Game &g, int dir){
+    int d = wallDistance(g, dir);
+    if(!d) return;
+    g.curX += dir * d;
+    updateGhost(g);
+}
+
+// SRS rotation of a piece at (x,y): tries the kick offsets for the transition
+// in order and stores the first free position in (outX,outY). Returns the kick
+// index used, or -1 when every test collides. Pure, so move generation can
+// enumerate reachable placements with it.
+int srsRotate(const Game &g, int pieceId, int rot, int x, int y, int dir, int &outX, int &outY){
+    int newRot = (rot + (dir>0 ? 1 : 3)) % 4;
+    if(pieceId==PIECE_O){
+        outX = x; outY = y;
+        return collides(g, pieceId, newRot, x, y) ? -1 : 0;
+    }
+    const Kick *tests = (pieceId==PIECE_I ? KICKS_I : KICKS_JLSTZ)[rot][dir>0 ? 0 : 1];
+    for(int i=0;i<5;++i){
+        int nx = x + tests[i].dx;
+        int ny = y - tests[i].dy; // board rows grow downwards
+        if(!collides(g, pieceId, newRot, nx, ny)){ outX = nx; outY = ny; return i; }
     }
-    // Render
-    clearScreen();
-    cout << "+" << string(BOARD_W,'-') << "+\n";
+    return -1;
+}
+
+// dir: +1 clockwise, -1 counter-clockwise
+bool rotateCurrent(Game &g, int dir){
+    int nx, ny;
+    if(srsRotate(g, g.curPieceId, g.curRot, g.curX, g.curY, dir, nx, ny) < 0) return false;
+    g.curRot = (g.curRot + (dir>0 ? 1 : 3)) % 4;
+    g.curX = nx; g.curY = ny;
+    updateGhost(g);
+    return true;
+}
+
+// Recompute the row bits and surface from the cells, for boards that were
+// written wholesale (garbage, network snapshots).
+void rebuildDerived(Game &g){
+    g.surf = Surface();
     for(int r=0;r<BOARD_H;++r){
-        cout << "|";
+        g.bits(r) = 0;
         for(int c=0;c<BOARD_W;++c){
-            char ch = out[r][c];
-            if(ch==' ') cout << ' ';
-            else cout << ch;
+            if(!g.cells(r)[c]) continue;
+            g.bits(r) |= RowBits(1) << c;
+            if(!g.surf.height[c]) g.surf.height[c] = BOARD_H - r;
+            g.surf.filled[c]++;
         }
-        cout << "|\n";
     }
-    cout << "+" << string(BOARD_W,'-') << "+\n";
-    cout << "Score: "<< g.score << "  Level: "<< g.level << "  Lines: "<< g.linesCleared << "\n";
-    // Next piece preview
-    cout << "Next:\n";
-    Piece np = rotatePiece(pieces[g.nextPieceId],0);
-    for(int r=0;r<4;++r){
-        for(int c=0;c<4;++c) cout << (np.cells[r][c] ? pieceChar(g.nextPieceId+1) : string(" "));
-        cout << "\n";
+    for(int c=0;c<BOARD_W;++c){
+        g.surf.maxHeight = max(g.surf.maxHeight, g.surf.height[c]);
+        g.surf.holes += g.surf.height[c] - g.surf.filled[c];
     }
-    cout << "Controls: a/d left-right, w rotate, s soft drop, space hard drop, p pause, q quit\n";
 }
 
-int main(){
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
-    srand((unsigned)time(nullptr));
+// Push n garbage rows (all filled except column hole) up from the bottom.
+// Blocks pushed off the top end the game. Rotating the ring moves the whole
+// board up, and the top n rows it recycles become the garbage, so this costs
+// O(n) rows plus an O(BOARD_W) surface update.
+const int GARBAGE_ID = 8;
 
-    initPieces();
-    initTerminal();
-    hideCursor();
+void insertGarbage(Game &g, int n, int hole){
+    n = min(n, BOARD_H);
+    bool toppedOut = false;
+    for(int r=0;r<n;++r) if(g.bits(r)) toppedOut = true;
+    g.base = g.slot(n);
+    RowBits holeBits = FULL_ROW & ~(RowBits(1) << hole);
+    for(int r=BOARD_H-n;r<BOARD_H;++r){
+        g.cells(r).fill(GARBAGE_ID);
+        g.cells(r)[hole] = 0;
+        g.bits(r) = holeBits;
+    }
+    if(toppedOut){ g.gameOver = true; rebuildDerived(g); return; }
+    // every column grew by n at the bottom, except that the hole column only
+    // gets taller (by n more holes) if it already had blocks
+    Surface &s = g.surf;
+    s.maxHeight = 0; s.holes = 0;
+    for(int c=0;c<BOARD_W;++c){
+        if(c != hole){ s.height[c] += n; s.filled[c] += n; }
+        else if(s.height[c]) s.height[c] += n;
+        s.maxHeight = max(s.maxHeight, s.height[c]);
+        s.holes += s.height[c] - s.filled[c];
+    }
+}
 
-    Game g;
-    g.board.assign(BOARD_H, vector<int>(BOARD_W,0));
-    g.nextPieceId = rand() % pieces.size();
-    spawnPiece(g);
+// Queue n incoming garbage rows; the hole column is drawn from the receiver's
+// generator now so that the rows that rise later are deterministic.
+void addGarbage(Game &g, int n){
+    if(n <= 0) return;
+    g.garbage.push(n, (int)(nextRandom(g.rng) % BOARD_W));
+}
 
-    using clk = chrono::steady_clock;
-    auto lastFall = clk::now();
-    double gravityInterval = 0.8; // seconds per automatic drop (will speed with level)
-    bool paused = false;
+// Versus attack, computed from the count clearLines() returns: a base per
+// lines cleared, a bonus for the combo (consecutive clearing locks), +1 for
+// back-to-back tetrises and a flat bonus for clearing the whole board.
+const int ATTACK_LINES[5] = {0,0,1,2,4};
+const int ATTACK_COMBO[12] = {0,0,1,1,2,2,3,3,4,4,4,5};
+const int ATTACK_PERFECT = 10;
+const int MAX_RISE_BATCHES = 4; // garbage batches that can rise per lock
 
-    while(true){
-    if(g.gameOver) break;
-    // adjust gravity based on level (simple exponential decay)
-    gravityInterval = max(0.05, 0.8 * pow(0.85, g.level-1));
+int attackFor(Game &g, int cleared){
+    if(cleared==0){ g.combo = -1; return 0; }
+    g.combo++;
+    int atk = ATTACK_LINES[cleared] + ATTACK_COMBO[min(g.combo, 11)];
+    if(cleared==4){ if(g.b2b) atk++; g.b2b = true; }
+    else g.b2b = false;
+    if(g.surf.maxHeight==0) atk += ATTACK_PERFECT;
+    return atk;
+}
 
-    // input handling (non-blocking)
-    while(kbHit()){
-        int ch = getChNonBlocking();
-        if(ch==-1) break;
-        // handle escape sequences for arrows on some terminals (simple support)
-        if(ch==27){ // ESC
-            // possibly arrow sequence
-            int n1 = getChNonBlocking();
-            if(n1==91){ // '['
-                int n2 = getChNonBlocking();
-                if(n2==65) ch='w'; // up
-                else if(n2==66) ch='s'; // down
-                else if(n2==67) ch='d'; // right
-                else if(n2==68) ch='a'; // left
-            }
+void lockPiece(Game &g){
+    TRACE_SPAN("lock");
+    g.lastLock = LockInfo();
+    g.lastLock.id = g.curPieceId; g.lastLock.rot = g.curRot;
+    g.lastLock.x = g.curX; g.lastLock.y = g.curY;
+    placePiece(g);
+    int cleared = clearLines(g);
+    // outgoing attack cancels queued garbage first; only the rest is sent
+    g.attackOut += g.garbage.cancel(attackFor(g, cleared));
+    LockInfo &li = g.lastLock;
+    while(cleared==0 && g.garbage.count && li.garbageBatches < MAX_RISE_BATCHES && !g.gameOver){
+        int n = min((int)g.garbage.rows[g.garbage.head], BOARD_H);
+        int hole = g.garbage.hole[g.garbage.head];
+        g.garbage.pop();
+        li.garbageRows[li.garbageBatches] = (uint8_t)n;
+        li.garbageHole[li.garbageBatches] = (uint8_t)hole;
+        li.garbageBatches++;
+        insertGarbage(g, n, hole);
+    }
+    g.pieces++;
+    if(!g.gameOver) spawnPiece(g);
+}
+
+// One row of gravity or soft drop; locks the piece when it is already resting.
+void stepDown(Game &g){
+    if(g.curY < g.ghostY) g.curY++;
+    else lockPiece(g);
+}
+
+void hardDrop(Game &g){
+    g.curY = g.ghostY;
+    lockPiece(g);
+}
+
+// Player inputs as one byte each, shared by the keyboard loop and the network.
+enum Action : uint8_t {
+    ACT_NONE = 0, ACT_LEFT, ACT_RIGHT, ACT_SOFT_DROP, ACT_HARD_DROP,
+    ACT_ROTATE_CW, ACT_ROTATE_CCW, ACT_HOLD, ACT_LEFT_WALL, ACT_RIGHT_WALL, ACT_COUNT
+};
+
+void applyAction(Game &g, int action){
+    if(g.gameOver) return;
+    TRACE_SPAN("input");
+    switch(action){
+        case ACT_LEFT: shiftPiece(g, -1); break;
+        case ACT_RIGHT: shiftPiece(g, +1); break;
+        case ACT_SOFT_DROP: stepDown(g); g.fallTimer = 0; break;
+        case ACT_HARD_DROP: hardDrop(g); g.fallTimer = 0; break;
+        case ACT_ROTATE_CW: rotateCurrent(g, +1); break;
+        case ACT_ROTATE_CCW: rotateCurrent(g, -1); break;
+        case ACT_HOLD: holdPiece(g); break;
+        case ACT_LEFT_WALL: shiftToWall(g, -1); break;
+        case ACT_RIGHT_WALL: shiftToWall(g, +1); break;
+        default: break;
+    }
+}
+
+// The simulation advances in fixed ticks so a game is a pure function of its
+// seed and the (tick, action) sequence, whether it runs locally or on a server.
+const int TICK_HZ = 60;
+
+// Ticks per row of gravity: 0.8s at level 1, 15% faster per level, floor 0.05s.
+int gravityTicks(int level){
+    return max(TICK_HZ/20, (int)lround(TICK_HZ * 0.8 * pow(0.85, level-1)));
+}
+
+// Returns true when gravity moved or locked the piece this tick.
+bool tickGame(Game &g){
+    if(g.gameOver) return false;
+    if(++g.fallTimer < gravityTicks(g.level)) return false;
+    g.fallTimer = 0;
+    TRACE_SPAN("gravity");
+    stepDown(g);
+    return true;
+}
+
+// Save/restore
+// A snapshot is a small header plus the Game bytes as they sit in memory:
+// Game is trivially copyable and holds no pointers, so saving is one write
+// and loading is one read into the struct with nothing to parse. The version
+// must be bumped whenever Game's layout changes; the size and checksum catch
+// files from other builds or ones that were cut short. Native byte order,
+// meant for the machine that wrote it (network resync has its own compact,
+// portable encoding).
+const uint32_t SNAPSHOT_MAGIC = 0x53525454; // "TTRS"
+const uint32_t SNAPSHOT_VERSION = 1;
+const size_t SNAPSHOT_GAME_SIZE = 632; // sizeof(Game) on 64-bit targets for this version
+
+// Catches most layout changes at compile time; --selftest checks the round trip.
+static_assert(sizeof(void*) != 8 || sizeof(Game) == SNAPSHOT_GAME_SIZE,
+              "Game's layout changed: bump SNAPSHOT_VERSION, then update SNAPSHOT_GAME_SIZE");
+
+struct GameSnapshot{
+    uint32_t magic, version, size, check;
+    Game game;
+};
+
+static_assert(is_trivially_copyable<GameSnapshot>::value, "snapshots are written and read as raw bytes");
+
+uint32_t snapshotCheck(const Game &g){
+    const uint8_t *p = (const uint8_t*)&g;
+    uint32_t h = 2166136261u;
+    for(size_t i=0;i<sizeof(Game);++i) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+GameSnapshot makeSnapshot(const Game &g){
+    GameSnapshot s;
+    memset((void*)&s, 0, sizeof s); // no stray padding bytes in files
+    s.magic = SNAPSHOT_MAGIC; s.version = SNAPSHOT_VERSION; s.size = sizeof(Game);
+    memcpy(&s.game, &g, sizeof g);
+    s.check = snapshotCheck(s.game);
+    return s;
+}
+
+bool restoreSnapshot(const GameSnapshot &s, Game &g){
+    if(s.magic != SNAPSHOT_MAGIC || s.version != SNAPSHOT_VERSION || s.size != sizeof(Game)) return false;
+    if(s.check != snapshotCheck(s.game)) return false;
+    memcpy(&g, &s.game, sizeof g);
+    return true;
+}
+
+// Written to a temporary file and renamed over the old save, so a crash
+// leaves either the old snapshot or the new one.
+bool saveGame(const string &path, const Game &g){
+    GameSnapshot s = makeSnapshot(g);
+    string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(!f) return false;
+    bool ok = fwrite(&s, sizeof s, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    remove(path.c_str()); // rename does not replace on Windows
+#endif
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool loadGame(const string &path, Game &g){
+    FILE *f = fopen(path.c_str(), "rb");
+    if(!f) return false;
+    GameSnapshot s;
+    bool ok = fread(&s, sizeof s, 1, f) == 1;
+    fclose(f);
+    return ok && restoreSnapshot(s, g);
+}
+
+// --selftest: snapshot round trips. A restored copy must be byte-identical and
+// must play on exactly like the original; damaged or foreign snapshots must
+// be refused. Returns the process exit code.
+int runSelfTest(){
+    int failures = 0;
+    set<string> reported;
+    auto check = [&](bool ok, const char *what){
+        if(ok) return;
+        if(reported.insert(what).second) cerr << "selftest: " << what << " failed\n";
+        ++failures;
+    };
+    uint64_t rs = 12345;
+    for(int trial=0;trial<200;++trial){
+        Game a;
+        newGame(a, nextRandom(rs));
+        for(int i=(int)(nextRandom(rs) % 400);i>0 && !a.gameOver;--i){ // play into a random state
+            if(nextRandom(rs) % 3) tickGame(a);
+            else applyAction(a, 1 + (int)(nextRandom(rs) % (ACT_COUNT-1)));
         }
-        if(ch=='q' || ch=='Q'){
-            g.gameOver = true; break;
-        } else if(ch=='p' || ch=='P'){
-            paused = !paused;
-        } else if(!paused){
-            if(ch=='a' || ch=='A'){
-                if(!collides(g, g.curPieceId, g.curRot, g.curX-1, g.curY)) g.curX--;
-            } else if(ch=='d' || ch=='D'){
-                if(!collides(g, g.curPieceId, g.curRot, g.curX+1, g.curY)) g.curX++;
-            } else if(ch=='s' || ch=='S' || ch== 'B'){
-                // soft drop
-                if(!collides(g, g.curPieceId, g.curRot, g.curX, g.curY+1)) g.curY++;
-                else { placePiece(g); clearLines(g); spawnPiece(g); }
-                lastFall = clk::now();
-            } else if(ch=='w' || ch=='W' || ch=='A'){
-                int newRot = (g.curRot+1)%4;
-                if(!collides(g, g.curPieceId, newRot, g.curX, g.curY)) g.curRot = newRot;
-            } else if(ch==' '){
-                // hard drop
-                while(!collides(g, g.curPieceId, g.curRot, g.curX, g.curY+1)) g.curY++;
-                placePiece(g);
-                clearLines(g);
-                spawnPiece(g);
-                lastFall = clk::now();
-            }
+        GameSnapshot s = makeSnapshot(a);
+        Game b;
+        check(restoreSnapshot(s, b), "restore");
+        check(memcmp((const void*)&a, (const void*)&b, sizeof a) == 0, "byte-equal restore");
+        for(int i=0;i<300 && !a.gameOver;++i){ // the same inputs on both copies
+            int act = (int)(nextRandom(rs) % (ACT_COUNT + 4)); // values past ACT_COUNT just tick
+            if(act > 0 && act < ACT_COUNT){ applyAction(a, act); applyAction(b, act); }
+            else { tickGame(a); tickGame(b); }
         }
+        check(memcmp((const void*)&a, (const void*)&b, sizeof a) == 0, "replay after restore");
+
+        GameSnapshot bad = s;
+        ((uint8_t*)&bad.game)[nextRandom(rs) % sizeof(Game)] ^= 1 << (nextRandom(rs) % 8);
+        check(!restoreSnapshot(bad, b), "corrupted byte rejected");
+        bad = s; bad.version++;
+        check(!restoreSnapshot(bad, b), "wrong version rejected");
+        bad = s; bad.magic = 0;
+        check(!restoreSnapshot(bad, b), "wrong magic rejected");
+        bad = s; bad.size--;
+        check(!restoreSnapshot(bad, b), "wrong size rejected");
     }
+    string path = "tetris-selftest.sav";
+    Game a, b;
+    newGame(a, 42);
+    for(int i=0;i<20;++i) applyAction(a, ACT_HARD_DROP);
+    check(saveGame(path, a) && loadGame(path, b) && memcmp((const void*)&a, (const void*)&b, sizeof a) == 0, "save/load file");
+    GameSnapshot half = makeSnapshot(a); // a save cut short by a crash
+    FILE *f = fopen(path.c_str(), "wb");
+    if(f){ fwrite(&half, sizeof half / 2, 1, f); fclose(f); }
+    check(!loadGame(path, b), "truncated file rejected");
+    remove(path.c_str());
+    cout << (failures ? "selftest FAILED\n" : "selftest passed\n");
+    return failures ? 1 : 0;
+}
 
-    if(paused){
-        // display paused state
-        drawGame(g);
-        cout << "*** PAUSED - press 'p' to resume ***\n";
-        Sleep(100); // pause for 100 milliseconds
+// High scores
+// Every finished game appends one fixed-size record to an append-only log.
+// O_APPEND makes each single write() land whole at the end, so any number of
+// game processes can share the log without locking. fsync is batched. A
+// compacted index holds the best TOP_SCORES records in order, plus how much of
+// the log it covers; startup maps the index and reads only the log written
+// after it. Any process may rewrite the index (temp file + rename): every
+// version is a correct summary of some prefix of the log.
+#ifndef _WIN32
+const uint32_t SCORE_MAGIC = 0x52435354;       // "TSCR"
+const uint32_t SCORE_INDEX_MAGIC = 0x58495354; // "TSIX"
+const uint32_t SCORE_INDEX_VERSION = 1;
+const int TOP_SCORES = 100;
+const int SCORE_SYNC_BATCH = 32;               // records between fsyncs...
+const int64_t SCORE_SYNC_MS = 1000;            // ...or this long after the first unsynced one
+const uint64_t SCORE_COMPACT_BYTES = 64 << 10; // log tail that triggers a new index
 
-        continue;
+struct ScoreRecord{
+    uint32_t magic;
+    uint32_t check;  // FNV of the rest; torn writes and stray bytes fail it
+    int64_t score;
+    int64_t when;    // unix seconds
+    uint32_t lines, pieces;
+    uint16_t level;
+    char name[30];
+};
+
+static_assert(sizeof(ScoreRecord) == 64, "one cache line per record");
+
+struct ScoreIndexHeader{
+    uint32_t magic, version, count, reserved;
+    uint64_t logBytes; // log prefix these records summarize
+};
+
+struct ScoreBoard{
+    string logPath, indexPath;
+    int logFd = -1, readFd = -1; // appends / reads
+    int unsynced = 0;
+    int64_t firstUnsynced = 0;
+    vector<ScoreRecord> top;     // best of the log's first readBytes, best first, at most TOP_SCORES
+    uint64_t indexedBytes = 0, readBytes = 0;
+};
+
+string scoresPath = "tetris.scores"; // --scores FILE; the index is FILE.idx
+
+int64_t steadyMs(){
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t scoreCheck(const ScoreRecord &r){
+    const uint8_t *p = (const uint8_t*)&r + 8;
+    uint32_t h = 2166136261u;
+    for(size_t i=8;i<sizeof r;++i) h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+ScoreRecord makeScoreRecord(const Game &g, const char *name){
+    ScoreRecord r;
+    memset(&r, 0, sizeof r);
+    r.magic = SCORE_MAGIC;
+    r.score = g.score; r.lines = g.linesCleared; r.level = (uint16_t)g.level; r.pieces = g.pieces;
+    r.when = (int64_t)time(nullptr);
+    snprintf(r.name, sizeof r.name, "%s", name);
+    r.check = scoreCheck(r);
+    return r;
+}
+
+// Higher score first; ties go to the earlier game.
+bool scoreBefore(const ScoreRecord &a, const ScoreRecord &b){
+    return a.score != b.score ? a.score > b.score : a.when < b.when;
+}
+
+// Returns the record's rank (0 = best) or -1 if it did not make the table.
+int mergeScore(ScoreBoard &sb, const ScoreRecord &r){
+    auto it = upper_bound(sb.top.begin(), sb.top.end(), r, scoreBefore);
+    int rank = (int)(it - sb.top.begin());
+    if(rank >= TOP_SCORES) return -1;
+    sb.top.insert(it, r);
+    if((int)sb.top.size() > TOP_SCORES) sb.top.pop_back();
+    return rank;
+}
+
+// Merge the records appended to the log since readBytes, by this process or
+// any other. Bytes that fail the check (a write cut short by a crash) are
+// skipped by searching for the next record; readBytes only moves past the
+// last good record, so one still being written is read again next time.
+void catchUpScores(ScoreBoard &sb){
+    struct stat st;
+    if(sb.readFd < 0 || fstat(sb.readFd, &st) != 0 || (uint64_t)st.st_size <= sb.readBytes) return;
+    string buf(st.st_size - sb.readBytes, '\0');
+    ssize_t n = pread(sb.readFd, &buf[0], buf.size(), (off_t)sb.readBytes);
+    if(n <= 0) return;
+    buf.resize(n);
+    size_t pos = 0, good = 0;
+    while(pos + sizeof(ScoreRecord) <= buf.size()){
+        ScoreRecord r;
+        memcpy(&r, buf.data() + pos, sizeof r);
+        if(r.magic == SCORE_MAGIC && r.check == scoreCheck(r)){
+            r.name[sizeof r.name - 1] = 0;
+            mergeScore(sb, r);
+            pos += sizeof r;
+            good = pos;
+        } else pos++;
     }
+    sb.readBytes += good;
+}
 
-    auto now = clk::now();
-    double elapsed = chrono::duration<double>(now - lastFall).count();
-    if(elapsed >= gravityInterval){
-        // try move down
-        if(!collides(g, g.curPieceId, g.curRot, g.curX, g.curY+1)){
-            g.curY++;
-        } else {
-            // place and spawn new
-            placePiece(g);
-            clearLines(g);
-            spawnPiece(g);
+bool openScores(ScoreBoard &sb, const string &path){
+    sb.logPath = path;
+    sb.indexPath = path + ".idx";
+    sb.logFd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(sb.logFd < 0) return false;
+    int idx = open(sb.indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(idx >= 0){
+        struct stat st;
+        if(fstat(idx, &st) == 0 && (size_t)st.st_size >= sizeof(ScoreIndexHeader)){
+            void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, idx, 0);
+            if(m != MAP_FAILED){
+                const ScoreIndexHeader *h = (const ScoreIndexHeader*)m;
+                const ScoreRecord *recs = (const ScoreRecord*)(h + 1);
+                if(h->magic == SCORE_INDEX_MAGIC && h->version == SCORE_INDEX_VERSION && h->count <= (uint32_t)TOP_SCORES
+                   && sizeof *h + h->count * sizeof(ScoreRecord) <= (size_t)st.st_size){
+                    sb.top.assign(recs, recs + h->count);
+                    sb.indexedBytes = h->logBytes;
+                }
+                munmap(m, st.st_size);
+            }
         }
-        lastFall = now;
+        close(idx);
     }
+    sb.readFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(sb.readFd < 0 || fstat(sb.readFd, &st) != 0) return false;
+    if(sb.indexedBytes > (uint64_t)st.st_size){ sb.top.clear(); sb.indexedBytes = 0; } // log was replaced
+    sb.readBytes = sb.indexedBytes;
+    catchUpScores(sb);
+    return true;
+}
 
-    drawGame(g);
-    // tiny sleep to limit CPU
-    Sleep(20); // pause for 20 milliseconds
+void syncScores(ScoreBoard &sb, int64_t nowMs, bool force){
+    if(sb.logFd < 0 || !sb.unsynced) return;
+    if(!force && sb.unsynced < SCORE_SYNC_BATCH && nowMs - sb.firstUnsynced < SCORE_SYNC_MS) return;
+#ifdef __APPLE__
+    if(fcntl(sb.logFd, F_FULLFSYNC) != 0) fsync(sb.logFd); // no fdatasync; fsync alone stops at the drive's cache
+#else
+    fdatasync(sb.logFd);
+#endif
+    sb.unsynced = 0;
+}
+
+// Write the table as the new index, covering the log up to readBytes.
+void compactScores(ScoreBoard &sb){
+    ScoreIndexHeader h{SCORE_INDEX_MAGIC, SCORE_INDEX_VERSION, (uint32_t)sb.top.size(), 0, sb.readBytes};
+    string tmp = sb.indexPath + "." + to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return;
+    string buf((const char*)&h, sizeof h);
+    buf.append((const char*)sb.top.data(), sb.top.size() * sizeof(ScoreRecord));
+    bool ok = write(fd, buf.data(), buf.size()) == (ssize_t)buf.size() && fsync(fd) == 0;
+    close(fd);
+    if(ok && rename(tmp.c_str(), sb.indexPath.c_str()) == 0) sb.indexedBytes = sb.readBytes;
+    else unlink(tmp.c_str());
+}
+
+// Append a finished game (one write) and return its rank in the table, or -1.
+int addScore(ScoreBoard &sb, const ScoreRecord &r, int64_t nowMs){
+    if(sb.logFd < 0) return -1;
+    if(write(sb.logFd, &r, sizeof r) != (ssize_t)sizeof r) return -1;
+    if(!sb.unsynced++) sb.firstUnsynced = nowMs;
+    syncScores(sb, nowMs, false);
+    catchUpScores(sb);
+    if(sb.readBytes - sb.indexedBytes >= SCORE_COMPACT_BYTES){ syncScores(sb, nowMs, true); compactScores(sb); }
+    for(size_t i=0;i<sb.top.size();++i) if(!memcmp(&sb.top[i], &r, sizeof r)) return (int)i;
+    return -1;
+}
+
+void closeScores(ScoreBoard &sb){
+    if(sb.logFd < 0) return;
+    syncScores(sb, 0, true);
+    catchUpScores(sb);
+    if(sb.readBytes != sb.indexedBytes) compactScores(sb);
+    close(sb.logFd);
+    close(sb.readFd);
+    sb.logFd = sb.readFd = -1;
+}
+
+// The versus server finishes games on its tick thread, which must never wait
+// on the disk. It queues records to a writer thread that owns the ScoreBoard
+// and does the appends, the batched fsyncs and compaction.
+struct ScoreWriter{
+    ScoreBoard sb;
+    mutex m;
+    condition_variable wake;
+    vector<ScoreRecord> queue;
+};
+
+void scoreWriterLoop(ScoreWriter &w){
+    vector<ScoreRecord> batch;
+    while(true){
+        {
+            unique_lock<mutex> lk(w.m);
+            auto queued = [&]{ return !w.queue.empty(); };
+            if(w.sb.unsynced) w.wake.wait_for(lk, chrono::milliseconds(SCORE_SYNC_MS), queued); // a batched fsync falls due
+            else w.wake.wait(lk, queued);
+            batch.swap(w.queue);
+        }
+        for(const ScoreRecord &r : batch) addScore(w.sb, r, steadyMs());
+        batch.clear();
+        syncScores(w.sb, steadyMs(), false);
+    }
+}
+
+void queueScore(ScoreWriter &w, const ScoreRecord &r){
+    { lock_guard<mutex> lk(w.m); w.queue.push_back(r); }
+    w.wake.notify_one();
+}
+#endif
+
+// Draw functions
+bool showGhost = true; // toggled with 'g'
+int previewCount = 5;  // pieces shown in the Next column (--preview N)
+
+char pieceChar(int id){
+    static const char *ch = "@#%*+xo="; // 7 pieces, then garbage
+    if(id<=0) return ' ';
+    int idx = (id-1) % 8;
+    return ch[idx];
+}
+
+// Colors. Screen cells carry a logical color; the SGR parameters for each one
+// come from tables filled once for the chosen mode, so emitting a color change
+// is a table lookup.
+enum ColorMode { COLOR_NONE, COLOR_256, COLOR_TRUE };
+ColorMode colorMode = COLOR_NONE; // --color none|256|truecolor; defaults from $COLORTERM and $TERM
+
+enum Color : uint8_t {
+    COL_DEFAULT = 0, // 1..7: pieces by id+1, in TETROMINO order
+    COL_GARBAGE = 8,
+    COL_BORDER,
+    COL_GHOST,
+    COL_COUNT
+};
+const uint32_t COLOR_RGB[COL_COUNT] = {
+    0, 0x00F0F0, 0x0000F0, 0xF0A000, 0xF0F000, 0x00F000, 0xA000F0, 0xF00000, // -, I J L O S T Z
+    0x808080, 0x707070, 0x3A3A3A                                             // garbage, border, ghost
+};
+array<string,COL_COUNT> sgrFg, sgrBg; // SGR parameters selecting each color
+
+// Nearest entry of the xterm 6x6x6 color cube.
+int rgbTo256(uint32_t rgb){
+    auto level = [](int v){ return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+    return 16 + 36*level(rgb >> 16 & 0xFF) + 6*level(rgb >> 8 & 0xFF) + level(rgb & 0xFF);
+}
+
+void initColors(){
+    for(int c=0;c<COL_COUNT;++c){
+        uint32_t rgb = COLOR_RGB[c];
+        char buf[24];
+        if(c == COL_DEFAULT){ sgrFg[c] = "39"; sgrBg[c] = "49"; continue; }
+        if(colorMode == COLOR_TRUE) snprintf(buf, sizeof buf, "8;2;%u;%u;%u", rgb >> 16 & 0xFF, rgb >> 8 & 0xFF, rgb & 0xFF);
+        else snprintf(buf, sizeof buf, "8;5;%d", rgbTo256(rgb));
+        sgrFg[c] = string("3") + buf;
+        sgrBg[c] = string("4") + buf;
+    }
+}
+
+int colorOf(int id){ return (id-1) % 8 + 1; } // board id (piece id+1, 8 garbage) -> Color
+
+// One character cell of the screen: a code point and its colors.
+struct Cell{
+    uint32_t ch = ' ';
+    uint8_t fg = COL_DEFAULT, bg = COL_DEFAULT;
+    bool operator==(const Cell &o) const { return ch == o.ch && fg == o.fg && bg == o.bg; }
+    bool operator!=(const Cell &o) const { return !(*this == o); }
+};
+// Screen rows; rows may differ in length. Frames are rebuilt every time
+// something changes, so rows past size() are kept for their storage and handed
+// out again by addLine(): drawing a frame does not allocate once the rows
+// have grown to their widest.
+struct Frame{
+    vector<vector<Cell>> rows;
+    size_t used = 0;
+
+    size_t size() const { return used; }
+    bool empty() const { return used == 0; }
+    vector<Cell> &operator[](size_t r){ return rows[r]; }
+    const vector<Cell> &operator[](size_t r) const { return rows[r]; }
+    vector<vector<Cell>>::iterator begin(){ return rows.begin(); }
+    vector<vector<Cell>>::iterator end(){ return rows.begin() + used; }
+    vector<vector<Cell>>::const_iterator begin() const { return rows.begin(); }
+    vector<vector<Cell>>::const_iterator end() const { return rows.begin() + used; }
+    vector<Cell> &addLine(){
+        if(used == rows.size()) rows.emplace_back();
+        vector<Cell> &line = rows[used++];
+        line.clear();
+        return line;
+    }
+    void resize(size_t n){
+        if(n < used) used = n;
+        while(used < n) addLine();
+    }
+    void clear(){ used = 0; }
+    void swap(Frame &o){ rows.swap(o.rows); std::swap(used, o.used); }
+};
+
+void appendText(vector<Cell> &line, string_view text, uint8_t fg = COL_DEFAULT){
+    for(char c : text) line.push_back(Cell{(uint8_t)c, fg, COL_DEFAULT});
+}
+
+// Append text to the frame, one row per '\n'-terminated line.
+void frameText(Frame &f, string_view text, uint8_t fg = COL_DEFAULT){
+    size_t at = 0;
+    while(at < text.size()){
+        size_t nl = text.find('\n', at);
+        if(nl == string::npos) nl = text.size();
+        appendText(f.addLine(), text.substr(at, nl - at), fg);
+        at = nl + 1;
+    }
+}
+
+// A filled board cell: the piece's glyph without color, a colored block with.
+Cell blockCell(int id){
+    if(id <= 0) return Cell{};
+    if(colorMode == COLOR_NONE) return Cell{(uint8_t)pieceChar(id)};
+    return Cell{' ', COL_DEFAULT, (uint8_t)colorOf(id)};
+}
+
+// Block modes pack several board cells into one character cell (--blocks):
+// half stacks two rows per character, quad a 2x2 square. A character shows two
+// colors, so the packed cells' most common color becomes the foreground, the
+// next the background, and the glyph is looked up from the mask of cells in
+// the foreground color.
+enum BlockMode { BLOCK_NONE, BLOCK_HALF, BLOCK_QUAD };
+BlockMode blockMode = BLOCK_NONE;
+
+// Glyph by quadrant mask: bit 0 top-left, 1 top-right, 2 bottom-left, 3 bottom-right.
+// Half mode only uses 0, 3 (top), 12 (bottom) and 15.
+const uint32_t QUAD_GLYPH[16] = {
+    ' ',    0x2598, 0x259D, 0x2580, 0x2596, 0x258C, 0x259E, 0x259B,
+    0x2597, 0x259A, 0x2590, 0x259C, 0x2584, 0x2599, 0x259F, 0x2588
+};
+
+// One character cell for up to four board pixels (logical colors, 0 empty),
+// given in quadrant order.
+Cell packCell(const uint8_t px[4]){
+    uint8_t fg = COL_DEFAULT, bg = COL_DEFAULT;
+    int best = 0;
+    for(int i=0;i<4;++i){
+        if(!px[i]) continue;
+        int n = (px[0]==px[i]) + (px[1]==px[i]) + (px[2]==px[i]) + (px[3]==px[i]);
+        if(n > best){ best = n; fg = px[i]; }
+    }
+    if(!best) return Cell{};
+    if(colorMode == COLOR_NONE){ // shape only; the ghost would look like a locked block, so it is left out
+        auto solid = [&](int i){ return px[i] && px[i] != COL_GHOST; };
+        int mask = solid(0) | solid(1) << 1 | solid(2) << 2 | solid(3) << 3;
+        return Cell{QUAD_GLYPH[mask]};
+    }
+    best = 0;
+    for(int i=0;i<4;++i){
+        if(px[i] == fg) continue;
+        int n = (px[0]==px[i]) + (px[1]==px[i]) + (px[2]==px[i]) + (px[3]==px[i]);
+        if(n > best){ best = n; bg = px[i]; }
+    }
+    int mask = (px[0]==fg) | (px[1]==fg) << 1 | (px[2]==fg) << 2 | (px[3]==fg) << 3;
+    return Cell{QUAD_GLYPH[mask], fg, bg};
+}
+
+// Append the packed cells for board pixel rows top and bottom (bottom may be
+// null past the last row), w pixels wide.
+void blockRow(const uint8_t *top, const uint8_t *bottom, int w, vector<Cell> &line){
+    static const uint8_t none[2] = {0, 0};
+    int step = blockMode == BLOCK_QUAD ? 2 : 1;
+    for(int c=0;c<w;c+=step){
+        const uint8_t *b = bottom ? bottom + c : none;
+        uint8_t px[4];
+        if(step == 2){
+            bool two = c + 1 < w;
+            px[0] = top[c]; px[1] = two ? top[c+1] : 0;
+            px[2] = b[0];   px[3] = two && bottom ? b[1] : 0;
+        } else { px[0] = px[1] = top[c]; px[2] = px[3] = b[0]; }
+        line.push_back(packCell(px));
+    }
+}
+
+// Where the game goes on screen, worked out for the window size whenever it
+// changes rather than every frame: the frame origin (centered across), whether
+// the hold/next column fits beside the board, how many previews fit under it
+// and whether there is room for the help line.
+struct Layout{
+    int rows = 24, cols = 80; // visible window
+    int top = 0, left = 0;    // frame origin
+    int lines = 0;            // board and sidebar rows
+    int preview = 0;          // preview pieces shown
+    bool sidebar = true, help = true;
+};
+
+Layout layout;
+
+// Append one line of the hold/next column: the two top rows of each piece in
+// spawn orientation, read straight from the queue.
+void sidebarRow(const Game &g, int i, vector<Cell> &line){
+    auto pieceRow = [&](int id, int r){
+        if(id<0) return;
+        const Piece &p = oriented[id][0].p;
+        for(int c=0;c<4;++c) line.push_back(p.cells[r][c] ? blockCell(id+1) : Cell{});
+    };
+    if(i==0) appendText(line, "Hold:");
+    else if(i<=2) pieceRow(g.holdId, i-1);
+    else if(i==4) appendText(line, "Next:");
+    else if(i>=5){
+        int k = (i-5) / 3, r = (i-5) % 3;
+        if(k < layout.preview && r < 2) pieceRow(g.queue.peek(k), r);
+    }
+}
+
+// The board as logical colors (board ids are their own color) with the ghost
+// and the falling piece drawn in.
+void boardPixels(const Game &g, bool ghost, uint8_t px[BOARD_H][BOARD_W]){
+    for(int r=0;r<BOARD_H;++r) for(int c=0;c<BOARD_W;++c) px[r][c] = g.cells(r)[c];
+    // overlay ghost (cached landing row) and current piece in the same pass
+    const Piece &p = oriented[g.curPieceId][g.curRot].p;
+    for(int r=0;r<4;++r) for(int c=0;c<4;++c){
+        if(!p.cells[r][c]) continue;
+        int bc = g.curX + c;
+        if(bc<0 || bc>=BOARD_W) continue;
+        int gr = g.ghostY + r;
+        if(ghost && gr>=0 && gr<BOARD_H && !px[gr][bc]) px[gr][bc] = COL_GHOST;
+        int br = g.curY + r;
+        if(br>=0 && br<BOARD_H) px[br][bc] = g.curPieceId+1;
+    }
+}
+
+int boardRows(){ return blockMode == BLOCK_NONE ? BOARD_H : (BOARD_H+1) / 2; }
+int boardCols(){ return blockMode == BLOCK_QUAD ? (BOARD_W+1) / 2 : BOARD_W; }
+
+// Append line i (0..boardRows()+1, borders included) of the board.
+void boardLine(vector<Cell> &line, const uint8_t px[BOARD_H][BOARD_W], int i, Cell ghostCell){
+    if(i==0 || i==boardRows()+1){ appendText(line, "+" + string(boardCols(),'-') + "+", COL_BORDER); return; }
+    appendText(line, "|", COL_BORDER);
+    if(blockMode == BLOCK_NONE)
+        for(int c=0;c<BOARD_W;++c) line.push_back(px[i-1][c] == COL_GHOST ? ghostCell : blockCell(px[i-1][c]));
+    else blockRow(px[2*i-2], 2*i-1 < BOARD_H ? px[2*i-1] : nullptr, BOARD_W, line);
+    appendText(line, "|", COL_BORDER);
+}
+
+Layout computeLayout(int rows, int cols){
+    Layout l;
+    l.rows = rows;
+    l.cols = cols;
+    int boardH = boardRows() + 2, boardW = boardCols() + 2;
+    const int SIDE_W = 2 + 5; // gap + "Hold:"
+    l.sidebar = cols >= boardW + SIDE_W;
+    l.preview = l.sidebar ? max(0, min(previewCount, (rows - 2 - 5) / 3)) : 0;
+    l.lines = max(boardH, l.sidebar ? 5 + 3*l.preview : 0);
+    l.help = rows >= l.lines + 2;
+    l.left = max(0, (cols - boardW - (l.sidebar ? SIDE_W : 0)) / 2);
+    return l;
+}
+
+// Re-lay out after a resize; true when it happened (the caller repaints).
+bool updateLayout(){
+    if(!takeResize()) return false;
+    int rows, cols;
+    terminalSize(rows, cols);
+    layout = computeLayout(rows, cols);
+    return true;
+}
+
+// Append the game's rows to f: board, hold/next column, score and help.
+void drawGame(Frame &f, const Game &g, bool ghost = showGhost){
+    TRACE_SPAN("render");
+    uint8_t px[BOARD_H][BOARD_W];
+    boardPixels(g, ghost, px);
+    Cell gc{'.', (uint8_t)(colorMode == COLOR_NONE ? COL_DEFAULT : colorOf(g.curPieceId+1))};
+    // Render: board on the left, hold/next column on the right
+    for(int i=0;i<layout.lines;++i){
+        vector<Cell> &line = f.addLine();
+        if(i < boardRows()+2) boardLine(line, px, i, gc);
+        else appendText(line, string(boardCols()+2,' '));
+        if(!layout.sidebar) continue;
+        appendText(line, "  ");
+        sidebarRow(g, i, line);
+    }
+    char buf[96];
+    snprintf(buf, sizeof buf, "Score: %lld  Level: %d  Lines: %d\n", g.score, g.level, g.linesCleared);
+    frameText(f, buf);
+    if(layout.help) frameText(f, "Controls: a/d left-right, w/z rotate, s soft drop, space hard drop, c hold, g ghost, f stats, p pause, q quit\n");
+}
+
+// Next key event (a character or a Key), -1 when none. Input is read at most
+// once per run of calls, so draining the keys each frame costs one syscall.
+int readKey(){
+    InputDecoder &in = input;
+    if(in.keyHead == in.keyTail){
+        int64_t now = inputNowMs();
+        decodeInput(now); // bytes left over when the queue was full
+        if(in.keyHead == in.keyTail && !in.polled){
+            in.polled = true;
+            fillInput();
+            decodeInput(now);
+        }
+        if(in.state == InputDecoder::ESC && now - in.escAt >= ESC_TIMEOUT_MS){
+            pushKey(KEY_ESC);
+            in.state = InputDecoder::GROUND;
+        }
+        if(in.keyHead == in.keyTail){ in.polled = false; return -1; }
+    }
+    return in.keys[in.keyHead++ & (KEY_QUEUE-1)];
+}
+
+int keyAction(int ch){
+    if(ch=='a' || ch=='A' || ch==KEY_LEFT) return ACT_LEFT;
+    if(ch=='d' || ch=='D' || ch==KEY_RIGHT) return ACT_RIGHT;
+    if(ch=='s' || ch=='S' || ch==KEY_DOWN) return ACT_SOFT_DROP;
+    if(ch=='w' || ch=='W' || ch==KEY_UP) return ACT_ROTATE_CW;
+    if(ch=='z' || ch=='Z') return ACT_ROTATE_CCW;
+    if(ch==' ') return ACT_HARD_DROP;
+    if(ch=='c' || ch=='C') return ACT_HOLD;
+    return ACT_NONE;
+}
+
+// Engine-side auto-repeat, run on the simulation tick so movement speed no
+// longer depends on the terminal's key repeat. Left/right: the first press
+// shifts once, after DAS ticks held the piece shifts every ARR ticks, and ARR
+// 0 sends it straight to the wall. Soft drop: one row per tick while held.
+// Without release events (no kitty protocol) a key counts as held while the
+// terminal keeps repeating it, released FALLBACK_RELEASE_MS after the last one.
+int dasTicks = 10, arrTicks = 2; // --das F, --arr F (frames at 60 Hz)
+const int64_t FALLBACK_RELEASE_MS = 100;
+
+struct AutoShift{
+    array<bool,3> held{};     // left, right, soft drop
+    array<int64_t,3> seen{};  // time of the last press or terminal repeat
+    int dir = 0;              // repeating direction: the last of left/right pressed
+    int charge = 0;           // ticks dir has been held
+};
+
+int autoShiftSlot(int key){
+    if(key=='a' || key=='A' || key==KEY_LEFT) return 0;
+    if(key=='d' || key=='D' || key==KEY_RIGHT) return 1;
+    if(key=='s' || key=='S' || key==KEY_DOWN) return 2;
+    return -1;
+}
+
+// Held keys repeat on ticks; otherwise auto-shift needs no wakeups.
+bool autoShiftActive(const AutoShift &as){ return as.held[0] || as.held[1] || as.held[2]; }
+
+void autoShiftRelease(AutoShift &as, int k){
+    as.held[k] = false;
+    if(k < 2 && as.dir == (k ? 1 : -1)){
+        as.dir = as.held[1-k] ? -as.dir : 0; // fall back to the other direction if still held
+        as.charge = 0;
+    }
+}
+
+// Feed a key event. Returns -1 for keys auto-repeat does not handle, otherwise
+// the action to apply now: the first shift or drop of a fresh press, or
+// ACT_NONE for releases and repeats.
+int autoShiftKey(AutoShift &as, int ch, int64_t nowMs){
+    int k = autoShiftSlot(ch & ~KEY_RELEASE);
+    if(k < 0) return -1;
+    if(ch & KEY_RELEASE){ autoShiftRelease(as, k); return ACT_NONE; }
+    as.seen[k] = nowMs;
+    if(as.held[k]) return ACT_NONE; // the terminal repeating a held key
+    as.held[k] = true;
+    if(k == 2) return ACT_SOFT_DROP;
+    as.dir = k ? 1 : -1;
+    as.charge = 0;
+    return as.dir < 0 ? ACT_LEFT : ACT_RIGHT;
+}
+
+// Actions due this tick (at most two), only ones that would move the piece.
+int autoShiftTick(AutoShift &as, const Game &g, int64_t nowMs, bool releases, int *acts){
+    if(!releases)
+        for(int k=0;k<3;++k) if(as.held[k] && nowMs - as.seen[k] > FALLBACK_RELEASE_MS) autoShiftRelease(as, k);
+    int n = 0;
+    if(as.dir){
+        int past = ++as.charge - dasTicks;
+        if(past >= 0 && (arrTicks == 0 || past % arrTicks == 0)
+           && !collides(g, g.curPieceId, g.curRot, g.curX + as.dir, g.curY)){
+            if(arrTicks == 0) acts[n++] = as.dir < 0 ? ACT_LEFT_WALL : ACT_RIGHT_WALL;
+            else acts[n++] = as.dir < 0 ? ACT_LEFT : ACT_RIGHT;
+        }
+    }
+    if(as.held[2] && g.curY < g.ghostY) acts[n++] = ACT_SOFT_DROP; // never locks; the press does that
+    return n;
+}
+
+// Metrics
+// Counters for long-running (hosted/kiosk) deployments. Every thread adds to
+// its own cache-line-aligned shard, which only that thread writes, so counting
+// is a plain load and store with no contention; the exporter sums the shards.
+enum Metric {
+    MET_GAMES_STARTED, MET_GAMES_FINISHED, MET_PIECES, MET_LINES, MET_SCORE, MET_LEVELS,
+    MET_FRAMES, MET_FRAME_NS, MET_RENDER_BYTES, MET_NET_BYTES, MET_COUNT
+};
+
+struct alignas(64) MetricShard{
+    array<atomic<uint64_t>,MET_COUNT> v{};
+    MetricShard *next = nullptr;
+};
+
+atomic<MetricShard*> metricShards{nullptr}; // every thread's shard, pushed on first use
+
+MetricShard &metricShard(){
+    thread_local MetricShard *shard = nullptr;
+    if(!shard){
+        shard = new MetricShard(); // never freed: totals outlive the thread
+        shard->next = metricShards.load();
+        while(!metricShards.compare_exchange_weak(shard->next, shard)){}
+    }
+    return *shard;
+}
+
+void metricAdd(Metric m, uint64_t n = 1){
+    atomic<uint64_t> &a = metricShard().v[m];
+    a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t metricTotal(Metric m){
+    uint64_t sum = 0;
+    for(MetricShard *s = metricShards.load(); s; s = s->next) sum += s->v[m].load(memory_order_relaxed);
+    return sum;
+}
+
+// Game progress between two points, counted from the Game fields themselves.
+struct GameTotals{
+    uint32_t pieces; int lines, level; long long score;
+};
+
+GameTotals totalsOf(const Game &g){ return {g.pieces, g.linesCleared, g.level, g.score}; }
+
+void countProgress(const GameTotals &before, const Game &g){
+    if(g.pieces == before.pieces) return;
+    metricAdd(MET_PIECES, g.pieces - before.pieces);
+    metricAdd(MET_LINES, g.linesCleared - before.lines);
+    metricAdd(MET_SCORE, (uint64_t)(g.score - before.score));
+    metricAdd(MET_LEVELS, g.level - before.level);
+}
+
+// Counts every byte written to stdout (the renderer's output) on its way
+// through to the real buffer. Installed on cout only when metrics are on.
+struct CountingBuf : streambuf{
+    streambuf *inner;
+    explicit CountingBuf(streambuf *in) : inner(in) {}
+    int overflow(int ch) override {
+        if(ch == EOF) return 0;
+        metricAdd(MET_RENDER_BYTES);
+        return inner->sputc((char)ch);
+    }
+    streamsize xsputn(const char *s, streamsize n) override {
+        metricAdd(MET_RENDER_BYTES, n);
+        return inner->sputn(s, n);
+    }
+    int sync() override { return inner->pubsync(); }
+};
+
+// Instrumentation
+// Log-linear latency histogram in the HdrHistogram style: values below 64ns
+// get a bucket each, every power of two above that is split into 32 buckets,
+// so any recorded value is off by at most ~3%. Fixed size, no allocation, and
+// recording is a shift and an increment.
+struct Histogram{
+    static const int SUB_BITS = 6, SUB = 1 << SUB_BITS, HALF = SUB / 2;
+    static const int MAX_BITS = 40; // ~18 minutes in ns
+    static const int BUCKETS = SUB + (MAX_BITS - SUB_BITS + 1) * HALF;
+    array<uint32_t,BUCKETS> counts{};
+    uint64_t total = 0, maxValue = 0;
+
+    static int bucketOf(uint64_t v){
+        v = min(v, (uint64_t(1) << MAX_BITS) - 1);
+        if(v < (uint64_t)SUB) return (int)v;
+        int shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1);
+        return SUB + (shift - 1) * HALF + (int)(v >> shift) - HALF;
+    }
+    static uint64_t bucketLow(int i){
+        if(i < SUB) return (uint64_t)i;
+        int shift = (i - SUB) / HALF + 1;
+        return (uint64_t)((i - SUB) % HALF + HALF) << shift;
+    }
+    void record(uint64_t ns){ counts[bucketOf(ns)]++; total++; maxValue = max(maxValue, ns); }
+    // Highest value equivalent to the p-th percentile (0..100).
+    uint64_t percentile(double p) const {
+        if(!total) return 0;
+        uint64_t want = max<uint64_t>(1, (uint64_t)ceil(p / 100.0 * total)), seen = 0;
+        for(int i=0;i<BUCKETS;++i){
+            seen += counts[i];
+            if(seen >= want) return min(maxValue, i+1 < BUCKETS ? bucketLow(i+1) - 1 : maxValue);
+        }
+        return maxValue;
+    }
+};
+
+// Stage timings of the local game loop. Timestamps come from steady_clock
+// (monotonic). Key-to-photon runs from reading a key to the flush of the
+// first frame that shows its effect.
+struct FrameStats{
+    Histogram frame, input, tick, draw, keyToPhoton;
+};
+
+FrameStats frameStats;
+bool showStats = false; // toggled with 'f'
+string statsPath;       // --stats FILE: percentiles appended every STATS_DUMP_SECONDS
+const int STATS_DUMP_SECONDS = 10;
+
+void writeStatsLine(ostream &os, const char *name, const Histogram &h){
+    char buf[160];
+    auto us = [](uint64_t ns){ return ns / 1000.0; };
+    snprintf(buf, sizeof buf, "%-8s n=%-7llu p50=%8.1f p90=%8.1f p99=%8.1f p99.9=%8.1f max=%8.1f us\n", name,
+             (unsigned long long)h.total, us(h.percentile(50)), us(h.percentile(90)), us(h.percentile(99)),
+             us(h.percentile(99.9)), us(h.maxValue));
+    os << buf;
+}
+
+void writeStats(ostream &os, const FrameStats &s){
+    writeStatsLine(os, "frame", s.frame);
+    writeStatsLine(os, "input", s.input);
+    writeStatsLine(os, "tick", s.tick);
+    writeStatsLine(os, "draw", s.draw);
+    writeStatsLine(os, "key2phot", s.keyToPhoton);
+}
+
+// Append the histograms so far to statsPath, stamped with seconds since start.
+void dumpStats(double elapsed, const FrameStats &s = frameStats){
+    if(statsPath.empty()) return;
+    ofstream f(statsPath, ios::app);
+    f << "# t=" << fixed << setprecision(1) << elapsed << "s\n";
+    writeStats(f, s);
+}
+
+// Session recording
+// --record FILE tees what the terminal is sent into an asciinema v2 cast: a
+// JSON header line, then one [seconds, "o", "bytes"] line per frame, which
+// `asciinema play` or the web player replays without the game. Frames are
+// taken after diffing, so a recording is about as large as the terminal
+// traffic. The renderer only appends the raw bytes and a timestamp to a
+// buffer under a short lock; a background thread escapes them into JSON and
+// writes them every CAST_FLUSH_MS (sooner past CAST_FLUSH_BYTES), so file I/O
+// never holds up a frame. While nothing is drawn it sleeps without a timer.
+const int CAST_FLUSH_MS = 250;
+const size_t CAST_FLUSH_BYTES = 1 << 16;
+
+struct CastEvent{
+    double t;     // seconds since the recording started
+    uint32_t len; // bytes that follow in CastRecorder::pending
+    char type;    // 'o' output, 'r' resize ("COLSxROWS")
+};
+
+struct CastRecorder{
+    FILE *f = nullptr;
+    chrono::steady_clock::time_point start;
+    mutex m;
+    condition_variable wake;
+    string pending; // CastEvent headers, each followed by its bytes
+    bool stop = false;
+    bool parked = false;    // writer found nothing to write last time and sleeps without a timer
+    int rows = 0, cols = 0; // size last recorded; touched by the drawing thread only
+    thread worker;
+};
+
+string castPath;              // --record FILE
+CastRecorder *cast = nullptr; // set before any thread draws
+
+void castEvent(CastRecorder &c, char type, string_view bytes){
+    if(bytes.empty()) return;
+    CastEvent e{chrono::duration<double>(chrono::steady_clock::now() - c.start).count(), (uint32_t)bytes.size(), type};
+    bool wake;
+    {
+        lock_guard<mutex> lk(c.m);
+        size_t before = c.pending.size();
+        c.pending.append((const char*)&e, sizeof e);
+        c.pending.append(bytes);
+        wake = c.parked || (before < CAST_FLUSH_BYTES && c.pending.size() >= CAST_FLUSH_BYTES);
+    }
+    if(wake) c.wake.notify_one();
+}
+
+// Frames are placed in a window the size of the terminal; record its changes.
+void castResize(CastRecorder &c, int rows, int cols){
+    if(rows == INT_MAX || (rows == c.rows && cols == c.cols)) return;
+    c.rows = rows;
+    c.cols = cols;
+    castEvent(c, 'r', to_string(cols) + "x" + to_string(rows));
+}
+
+// Append bytes as a JSON string body. Frames are whole UTF-8 sequences, so
+// only quotes, backslashes and control bytes need escaping.
+void appendJsonEscaped(string &out, string_view s){
+    for(char ch : s){
+        unsigned char u = ch;
+        if(u == '"' || u == '\\'){ out += '\\'; out += ch; }
+        else if(u < 0x20 || u == 0x7F){
+            char buf[8];
+            out.append(buf, snprintf(buf, sizeof buf, "\\u%04x", u));
+        }
+        else out += ch;
+    }
+}
+
+void castLoop(CastRecorder &c){
+    string batch, json;
+    batch.reserve(2 * CAST_FLUSH_BYTES); // swapped into pending: appends rarely reallocate
+    unique_lock<mutex> lk(c.m);
+    while(true){
+        if(c.parked) c.wake.wait(lk, [&]{ return c.stop || !c.pending.empty(); });
+        else c.wake.wait_for(lk, chrono::milliseconds(CAST_FLUSH_MS), [&]{ return c.stop || c.pending.size() >= CAST_FLUSH_BYTES; });
+        c.parked = c.pending.empty(); // an idle game leaves the writer with no timer
+        batch.swap(c.pending);
+        bool done = c.stop;
+        lk.unlock();
+        json.clear();
+        for(size_t p=0;p<batch.size();){
+            CastEvent e;
+            memcpy(&e, batch.data() + p, sizeof e);
+            p += sizeof e;
+            char head[48];
+            json.append(head, snprintf(head, sizeof head, "[%.6f, \"%c\", \"", e.t, e.type));
+            appendJsonEscaped(json, string_view(batch).substr(p, e.len));
+            json += "\"]\n";
+            p += e.len;
+        }
+        batch.clear();
+        if(!json.empty()){
+            fwrite(json.data(), 1, json.size(), c.f);
+            fflush(c.f);
+        }
+        if(done) break;
+        lk.lock();
+    }
+}
+
+void stopCast(){
+    if(!cast) return;
+    {
+        lock_guard<mutex> lk(cast->m);
+        cast->stop = true;
+    }
+    cast->wake.notify_one();
+    if(cast->worker.joinable()) cast->worker.join();
+    fclose(cast->f);
+}
+
+// Open --record's file and write the header. Returns false if it cannot be created.
+bool startCast(){
+    FILE *f = fopen(castPath.c_str(), "w");
+    if(!f){ perror("record"); return false; }
+    cast = new CastRecorder(); // lives until exit; stopCast() runs from atexit
+    cast->f = f;
+    cast->start = chrono::steady_clock::now();
+    cast->pending.reserve(2 * CAST_FLUSH_BYTES);
+    terminalSize(cast->rows, cast->cols);
+    const char *term = getenv("TERM");
+    string env;
+    appendJsonEscaped(env, term ? term : "xterm-256color");
+    fprintf(f, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld, \"env\": {\"TERM\": \"%s\"}}\n",
+            cast->cols, cast->rows, (long long)time(nullptr), env.c_str());
+    castEvent(*cast, 'o', "\x1b[?25l"); // the game hides the cursor before its first frame
+    cast->worker = thread(castLoop, ref(*cast));
+    atexit(stopCast);
+    return true;
+}
+
+// Screen output
+// Frames are diffed against what the terminal already shows, so a frame costs
+// a cursor move and the changed spans of each changed row, not a full
+// repaint. The encoder also tracks the terminal's current colors and emits an
+// SGR sequence only where a span's color changes, so a run of same-colored
+// cells costs one escape, not one per cell. Writes never block: stdout is
+// non-blocking and holds at most one frame of bytes in flight. Frames
+// submitted while those drain replace each other, and only the newest is
+// encoded once the terminal has caught up. On a slow link the picture skips
+// frames instead of falling seconds behind.
+struct TermOut{
+    Frame shown;          // screen once the bytes in flight have drained
+    string out;           // encoded bytes in flight
+    size_t outPos = 0;
+    Frame next;           // newest frame not yet encoded
+    bool hasNext = false;
+    bool repaint = true;  // clear and draw everything (first frame)
+    uint8_t fg = COL_DEFAULT, bg = COL_DEFAULT; // terminal colors once out drains
+    int row = -1, col = -1; // terminal cursor once out drains (frame coordinates), -1 unknown
+    int top = 0, left = 0;  // where frame row/column 0 goes on screen
+    int rows = INT_MAX, cols = INT_MAX; // visible window; frames are clipped to it
+    uint64_t nextTag = 0, outTag = 0, doneTag = 0; // caller's ids: pending, in flight, fully written
+};
+
+// Unchanged cells between two changed spans of a row shorter than this are
+// rewritten instead of skipped with a cursor move (which costs ~7 bytes).
+const int DIFF_GAP = 6;
+
+void setOutputBlocking(bool blocking){
+#ifndef _WIN32
+    int flags = fcntl(STDOUT_FILENO, F_GETFL, 0);
+    fcntl(STDOUT_FILENO, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#else
+    (void)blocking;
+#endif
+}
+
+// Queue f as the next frame, replacing any frame still waiting. f gets the
+// replaced frame's storage back.
+void submitFrame(TermOut &t, Frame &f, uint64_t tag = 0){
+    t.next.swap(f);
+    f.clear();
+    t.hasNext = true;
+    t.nextTag = tag;
+}
+
+// Place frames at (top, left) in a rows x cols window; anything that falls
+// outside is never sent. A change repaints.
+void setViewport(TermOut &t, int top, int left, int rows, int cols){
+    if(t.top == top && t.left == left && t.rows == rows && t.cols == cols) return;
+    t.top = top; t.left = left; t.rows = rows; t.cols = cols;
+    t.repaint = true;
+}
+
+void clipFrame(Frame &f, int rows, int cols){
+    if((int)f.size() > rows) f.resize(max(0, rows));
+    for(vector<Cell> &line : f) if((int)line.size() > cols) line.resize(max(0, cols));
+}
+
+void moveCursor(TermOut &t, int row, int col){
+    if(t.row == row && t.col == col) return;
+    char buf[24];
+    t.out.append(buf, snprintf(buf, sizeof buf, "\x1b[%d;%dH", t.top + row + 1, t.left + col + 1));
+    t.row = row;
+    t.col = col;
+}
+
+void setColors(TermOut &t, uint8_t fg, uint8_t bg){
+    if(colorMode == COLOR_NONE || (fg == t.fg && bg == t.bg)) return;
+    if(fg == COL_DEFAULT && bg == COL_DEFAULT) t.out += "\x1b[m";
+    else {
+        t.out += "\x1b[";
+        if(fg != t.fg) t.out += sgrFg[fg];
+        if(bg != t.bg){
+            if(fg != t.fg) t.out += ';';
+            t.out += sgrBg[bg];
+        }
+        t.out += 'm';
+    }
+    t.fg = fg;
+    t.bg = bg;
+}
+
+void putCell(TermOut &t, const Cell &c){
+    setColors(t, c.fg, c.bg);
+    uint32_t u = c.ch;
+    if(u < 0x80) t.out += (char)u;
+    else if(u < 0x800){ t.out += (char)(0xC0 | u >> 6); t.out += (char)(0x80 | (u & 0x3F)); }
+    else {
+        t.out += (char)(0xE0 | u >> 12);
+        t.out += (char)(0x80 | (u >> 6 & 0x3F));
+        t.out += (char)(0x80 | (u & 0x3F));
+    }
+    t.col++;
+}
+
+// Append the bytes turning t.shown into t.next: per row, the runs of changed
+// cells, with the rest erased if the row got shorter.
+void encodeDiff(TermOut &t){
+    static const vector<Cell> empty;
+    size_t rows = max(t.shown.size(), t.next.size());
+    for(size_t r=0;r<rows;++r){
+        const vector<Cell> &a = r < t.shown.size() ? t.shown[r] : empty, &b = r < t.next.size() ? t.next[r] : empty;
+        if(a == b) continue;
+        size_t n = b.size();
+        auto changed = [&](size_t i){ return i >= a.size() || a[i] != b[i]; };
+        for(size_t i=0;i<n;){
+            if(!changed(i)){ ++i; continue; }
+            size_t e = i + 1, same = 0; // extend over short unchanged gaps
+            for(size_t k=e;k<n && same<(size_t)DIFF_GAP;++k){
+                if(changed(k)){ e = k + 1; same = 0; }
+                else ++same;
+            }
+            moveCursor(t, (int)r, (int)i);
+            for(;i<e;++i) putCell(t, b[i]);
+        }
+        if(n < a.size()){
+            moveCursor(t, (int)r, (int)n);
+            setColors(t, t.fg, COL_DEFAULT); // erasing fills with the current background
+            t.out += "\x1b[K";
+        }
+    }
+}
+
+// Write as much as the terminal takes right now, encoding the pending frame
+// once the previous one is out. Returns true while bytes are left (wait for
+// POLLOUT on stdout and call again).
+bool pumpTerm(TermOut &t){
+    while(true){
+        if(t.outPos == t.out.size()){
+            t.doneTag = t.outTag;
+            if(!t.hasNext) return false;
+            t.out.clear();
+            t.outPos = 0;
+            if(t.repaint){
+                if(cast) castResize(*cast, t.rows, t.cols);
+#ifdef _WIN32
+                cout.flush();
+                clearScreen(); // the visible window only
+                if(cast) castEvent(*cast, 'o', "\x1b[H\x1b[2J");
+                t.out += "\x1b[m";
+#else
+                t.out += "\x1b[m\x1b[H\x1b[2J";
+#endif
+                t.shown.clear();
+                t.fg = t.bg = COL_DEFAULT;
+                t.row = -t.top; // home is the window's corner, not the frame's
+                t.col = -t.left;
+                t.repaint = false;
+            }
+            clipFrame(t.next, t.rows - t.top, t.cols - t.left);
+            encodeDiff(t);
+            t.shown.swap(t.next);
+            t.hasNext = false;
+            t.outTag = t.nextTag;
+            if(t.out.empty()) continue;
+            if(cast) castEvent(*cast, 'o', t.out);
+        }
+#ifdef _WIN32
+        cout.write(t.out.data() + t.outPos, t.out.size() - t.outPos);
+        cout.flush();
+        t.outPos = t.out.size();
+#else
+        ssize_t n = write(STDOUT_FILENO, t.out.data() + t.outPos, t.out.size() - t.outPos);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return true; // the terminal is behind
+            if(errno != EINTR) t.outPos = t.out.size(); // output gone: drop the frame
+            continue;
+        }
+        metricAdd(MET_RENDER_BYTES, n);
+        t.outPos += n;
+#endif
+    }
+}
+
+// Finish the frame in flight and the pending one with blocking writes, and
+// leave the cursor below them for whatever is printed next.
+void drainTerm(TermOut &t){
+    setOutputBlocking(true);
+    pumpTerm(t);
+    t.out.clear();
+    t.outPos = 0;
+    setColors(t, COL_DEFAULT, COL_DEFAULT);
+    moveCursor(t, (int)t.shown.size(), -t.left);
+    if(cast) castEvent(*cast, 'o', t.out);
+    pumpTerm(t);
+}
+
+// Render thread
+// The local game draws on its own thread, so a slow terminal (ssh, a busy
+// multiplexer) holds up the picture but never gravity or input. The
+// simulation copies everything a frame needs into a snapshot and publishes it
+// through a triple buffer: one slot the simulation writes, one the renderer
+// reads, and a middle slot the two swap with a single atomic exchange. Neither
+// side waits for the other; frames the renderer was too slow to show are
+// overwritten and never drawn.
+struct FrameSnapshot{
+    Game game;
+    uint64_t seq = 0;
+    bool paused = false, ghost = true, stats = false;
+    chrono::steady_clock::time_point keyTime{}; // earliest key not yet on screen, or zero
+    FrameStats timings; // frame/input/tick copied only while shown or dumped; the renderer fills in its own
+};
+
+template<class T> struct TripleBuffer{
+    static const uint8_t FRESH = 4; // set in middle while it holds a value the reader has not taken
+    array<T,3> slots;
+    atomic<uint8_t> middle{1};
+    uint8_t back = 0;  // writer's slot
+    uint8_t front = 2; // reader's slot
+
+    T &writeSlot(){ return slots[back]; }
+    void publish(){ back = middle.exchange(back | FRESH, memory_order_acq_rel) & 3; }
+    bool fresh() const { return middle.load(memory_order_acquire) & FRESH; }
+    // Newest published value, or nullptr when nothing was published since the last call.
+    T *takeLatest(){
+        if(!fresh()) return nullptr;
+        front = middle.exchange(front, memory_order_acq_rel) & 3;
+        return &slots[front];
+    }
+};
+
+struct Renderer{
+    TripleBuffer<FrameSnapshot> frames;
+    TermOut term;
+    atomic<uint64_t> shownSeq{0}; // seq of the last frame flushed to the terminal
+    atomic<bool> stop{false};
+    mutex m;                      // only for sleeping; frames never pass under it
+    condition_variable wake;
+    thread worker;
+};
+
+void renderLoop(Renderer &r, chrono::steady_clock::time_point startTime){
+    using clk = chrono::steady_clock;
+    auto ns = [](clk::duration d){ return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(d).count(); };
+    auto nextDump = startTime + chrono::seconds(STATS_DUMP_SECONDS);
+    TermOut &term = r.term;
+    // key times of the frame queued in term and the one in flight, by seq
+    uint64_t pendingSeq = 0, flightSeq = 0;
+    clk::time_point pendingKey{}, flightKey{}, lastKey{};
+    Frame frame;
+    ostringstream os;
+    while(true){
+        bool busy = pumpTerm(term);
+        if(term.doneTag && r.shownSeq.load(memory_order_relaxed) != term.doneTag){
+            clk::time_point key = term.doneTag == pendingSeq ? pendingKey : term.doneTag == flightSeq ? flightKey : clk::time_point{};
+            if(key != clk::time_point{} && key != lastKey){
+                frameStats.keyToPhoton.record(ns(clk::now() - key));
+                lastKey = key;
+            }
+            r.shownSeq.store(term.doneTag, memory_order_release);
+        }
+        if(term.outTag == pendingSeq){ flightSeq = pendingSeq; flightKey = pendingKey; }
+        if(busy){
+#ifndef _WIN32
+            pollfd pfd = {STDOUT_FILENO, POLLOUT, 0};
+            poll(&pfd, 1, 10);
+#endif
+            if(r.stop.load()) break;
+        } else {
+            unique_lock<mutex> lk(r.m);
+            r.wake.wait(lk, [&]{ return r.stop.load() || r.frames.fresh(); });
+        }
+        if(r.stop.load()) break;
+        FrameSnapshot *f = r.frames.takeLatest();
+        if(!f) continue;
+        auto t0 = clk::now();
+        if(updateLayout()) setViewport(term, layout.top, layout.left, layout.rows, layout.cols);
+        drawGame(frame, f->game, f->ghost);
+        if(f->paused) frameText(frame, "*** PAUSED - press 'p' to resume ***\n");
+        FrameStats &fs = f->timings;
+        if(f->stats || !statsPath.empty()){
+            fs.draw = frameStats.draw;
+            fs.keyToPhoton = frameStats.keyToPhoton;
+        }
+        if(f->stats){
+            os.str("");
+            writeStats(os, fs);
+            frameText(frame, os.str());
+        }
+        submitFrame(term, frame, f->seq);
+        pendingSeq = f->seq;
+        pendingKey = f->keyTime;
+        auto t1 = clk::now();
+        frameStats.draw.record(ns(t1 - t0));
+        if(t1 >= nextDump){
+            dumpStats(chrono::duration<double>(t1 - startTime).count(), fs);
+            nextDump = t1 + chrono::seconds(STATS_DUMP_SECONDS); // one dump after an idle stretch, not one per missed period
+        }
+    }
+    drainTerm(term);
+}
+
+void wakeRenderer(Renderer &r){
+    { lock_guard<mutex> lk(r.m); } // orders the publish before a renderer about to sleep re-checks
+    r.wake.notify_one();
+}
+
+void stopRenderer(Renderer &r){
+    r.stop.store(true);
+    wakeRenderer(r);
+    if(r.worker.joinable()) r.worker.join();
+}
+
+#ifdef __linux__
+// ---------------------------------------------------------------------------
+// Networked versus play. One server process runs every game on a single epoll
+// loop; clients are the terminal client (--connect) or the loopback load
+// generator (--loadtest). Addresses are PORT, HOST:PORT or unix:PATH.
+//
+// Wire format: frames of [u8 type][u8 payload length][payload], integers little
+// endian. A client gets a full snapshot when its match starts (or when it asks
+// for a resync); after that the server only sends what changed: the falling
+// piece's position, each lock as the piece plus its cleared-row mask, hold
+// swaps, pending garbage and match status. The client replays those on its own
+// copy of the game with the same code, and checks the board hash each lock
+// carries.
+//
+// Inputs carry a sequence number and the server acknowledges the last one it
+// applied, so the client can predict: it applies its own inputs immediately
+// and, whenever the confirmed state moves, rolls back to it and re-applies the
+// inputs the server has not acknowledged yet.
+
+enum MsgType : uint8_t {
+    // server -> client
+    MSG_SNAPSHOT = 1, // full state, see encodeSnapshot()
+    MSG_MOVE,         // i8 x, i8 y, u8 rot of the falling piece
+    MSG_LOCK,         // u8 id|rot<<4, i8 x, i8 y, u24 cleared rows, u8 revealed preview, u16 board hash,
+                      //   u8 garbage batches that rose, then u8 rows, u8 hole per batch
+    MSG_HOLD,         // u8 hold id, u8 new current id, u8 revealed preview (NO_PIECE if none)
+    MSG_GARBAGE,      // u8 pending garbage rows
+    MSG_STATUS,       // u8 Status
+    MSG_ACK,          // u16 sequence number of the last input applied
+    // client -> server
+    MSG_INPUT = 16,   // u16 sequence number, u8 Action
+    MSG_RESYNC,       // ask for a snapshot
+    MSG_PLAY,         // first frame: join the match queue
+    MSG_SPECTATE      // first frame: i32 player slot to watch (-1 = any match)
+};
+enum Status : uint8_t { ST_WAITING = 0, ST_PLAYING, ST_WON, ST_LOST };
+
+const int NET_PREVIEW = 5;        // preview pieces a client keeps
+const int NO_PIECE = 0xFF;
+const size_t MAX_BACKLOG = 65536; // unsent bytes before a client counts as dead
+
+static_assert(BOARD_H <= 24, "cleared-row masks are sent as 24 bits");
+
+struct Writer{
+    uint8_t *p;
+    void u8(int v){ *p++ = (uint8_t)v; }
+    void u16(unsigned v){ u8(v & 0xFF); u8(v >> 8); }
+    void u24(uint32_t v){ u16(v & 0xFFFF); u8(v >> 16); }
+    void u32(uint32_t v){ u16(v & 0xFFFF); u16(v >> 16); }
+};
+
+struct Reader{
+    const uint8_t *p, *end;
+    bool ok = true;
+    int u8(){ if(p>=end){ ok = false; return 0; } return *p++; }
+    int i8(){ return (int8_t)u8(); }
+    unsigned u16(){ unsigned lo = u8(); return lo | (unsigned)u8() << 8; }
+    uint32_t u24(){ uint32_t lo = u16(); return lo | (uint32_t)u8() << 16; }
+    uint32_t u32(){ uint32_t lo = u16(); return lo | (uint32_t)u16() << 16; }
+};
+
+// Append one frame to out; fill writes the payload through the Writer.
+template<class F> void putFrame(string &out, int type, F fill){
+    uint8_t buf[2 + 255];
+    Writer w{buf + 2};
+    fill(w);
+    size_t len = w.p - (buf + 2);
+    buf[0] = (uint8_t)type; buf[1] = (uint8_t)len;
+    out.append((const char*)buf, len + 2);
+}
+
+// Split complete frames off the front of buf; calls f(type, reader) for each.
+template<class F> void drainFrames(string &buf, F f){
+    size_t pos = 0;
+    while(buf.size() - pos >= 2){
+        const uint8_t *h = (const uint8_t*)buf.data() + pos;
+        size_t len = h[1];
+        if(buf.size() - pos < 2 + len) break;
+        Reader rd{h + 2, h + 2 + len};
+        f(h[0], rd);
+        pos += 2 + len;
+    }
+    buf.erase(0, pos);
+}
+
+// Cheap fingerprint of the board and score, sent with every lock so a client
+// notices when its replica has drifted.
+uint16_t boardHash(const Game &g){
+    uint32_t h = 2166136261u;
+    for(int r=0;r<BOARD_H;++r) h = (h ^ (uint32_t)g.bits(r)) * 16777619u;
+    h = (h ^ (uint32_t)g.score) * 16777619u;
+    return (uint16_t)(h ^ (h >> 16));
+}
+
+void encodeSnapshot(Writer &w, const Game &g, int status){
+    w.u8(status);
+    w.u8(g.curPieceId); w.u8(g.curRot); w.u8(g.curX); w.u8(g.curY);
+    w.u8(g.holdId); w.u8(g.canHold);
+    for(int i=0;i<NET_PREVIEW;++i) w.u8(g.queue.peek(i));
+    w.u32((uint32_t)g.score); w.u16(g.level); w.u16(g.linesCleared); w.u8(min(g.garbage.total, 255));
+    w.u32(g.pieces);
+    for(int r=0;r<BOARD_H;++r) for(int c=0;c<BOARD_W;c+=2)
+        w.u8(g.cells(r)[c] | (c+1<BOARD_W ? g.cells(r)[c+1] << 4 : 0));
+}
+
+static_assert(27 + BOARD_H * ((BOARD_W+1)/2) <= 255, "snapshot must fit one frame");
+
+// The client only shows incoming garbage (the server decides where it rises
+// and reports that with each lock), so the count goes to incoming rather than
+// into the replica's queue.
+bool decodeSnapshot(Reader &rd, Game &g, int &status, int &incoming){
+    g = Game();
+    status = rd.u8();
+    g.curPieceId = rd.u8(); g.curRot = rd.u8(); g.curX = rd.i8(); g.curY = rd.i8();
+    g.holdId = rd.i8(); g.canHold = rd.u8();
+    for(int i=0;i<NET_PREVIEW;++i) g.queue.push(rd.u8() % 7);
+    g.score = rd.u32(); g.level = rd.u16(); g.linesCleared = rd.u16(); incoming = rd.u8();
+    g.pieces = rd.u32();
+    for(int r=0;r<BOARD_H;++r) for(int c=0;c<BOARD_W;c+=2){
+        int b = rd.u8();
+        g.cells(r)[c] = b & 0x0F;
+        if(c+1<BOARD_W) g.cells(r)[c+1] = b >> 4;
+    }
+    if(!rd.ok || g.curPieceId >= 7 || g.curRot >= 4 || g.holdId >= 7) return false;
+    rebuildDerived(g);
+    updateGhost(g);
+    return true;
+}
+
+// Replay a lock reported by the server on a client's copy of the game.
+void replayLock(Game &g, const LockInfo &lk, int reveal){
+    g.curPieceId = lk.id; g.curRot = lk.rot; g.curX = lk.x; g.curY = lk.y;
+    placePiece(g);
+    removeRows(g, lk.clearedMask);
+    for(int i=0;i<lk.garbageBatches;++i) insertGarbage(g, lk.garbageRows[i], lk.garbageHole[i]);
+    g.pieces++;
+    startPiece(g, g.queue.pop());
+    if(reveal < 7) g.queue.push(reveal);
+    g.canHold = true;
+}
+
+void replayHold(Game &g, int holdId, int curId, int reveal){
+    if(g.holdId < 0) g.queue.pop(); // an empty slot made the server spawn the next piece
+    g.holdId = holdId;
+    startPiece(g, curId);
+    if(reveal < 7) g.queue.push(reveal);
+    g.canHold = false;
+}
+
+struct SockAddr{
+    sockaddr_storage ss{};
+    socklen_t len = 0;
+};
+
+// A bare PORT listens on defaultHost.
+bool parseAddr(const string &spec, SockAddr &out, const char *defaultHost = "0.0.0.0"){
+    if(spec.rfind("unix:", 0) == 0){
+        sockaddr_un *un = (sockaddr_un*)&out.ss;
+        string path = spec.substr(5);
+        if(path.empty() || path.size() >= sizeof(un->sun_path)) return false;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path.c_str());
+        out.len = sizeof(sockaddr_un);
+        return true;
+    }
+    size_t colon = spec.rfind(':');
+    string host = colon==string::npos ? defaultHost : spec.substr(0, colon);
+    string port = colon==string::npos ? spec : spec.substr(colon+1);
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) return false;
+    memcpy(&out.ss, res->ai_addr, res->ai_addrlen);
+    out.len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+void setNoDelay(int fd){
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one); // fails harmlessly on unix sockets
+}
+
+int connectTo(const SockAddr &a, bool nonBlocking){
+    int fd = socket(a.ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0), 0);
+    if(fd < 0) return -1;
+    if(connect(fd, (const sockaddr*)&a.ss, a.len) < 0 && errno != EINPROGRESS){ close(fd); return -1; }
+    setNoDelay(fd);
+    return fd;
+}
+
+// Server-side connection. Kept small; the Game it drives lives at the same
+// index in Server::games so the tick loop walks one dense array.
+enum Role : uint8_t { ROLE_NEW = 0, ROLE_PLAYER, ROLE_SPECTATOR };
+
+struct Conn{
+    int fd = -1;
+    int opponent = -1;
+    uint8_t role = ROLE_NEW;    // decided by the client's first frame
+    uint8_t status = ST_WAITING;
+    bool writeBlocked = false;  // waiting for EPOLLOUT
+    bool wantSnapshot = false;
+    bool watched = false;       // has a spectator stream in Server::streams
+    uint8_t inCount = 0;
+    array<uint8_t,8> inputs{};  // actions waiting for the next tick
+    uint16_t lastSeq = 0, sentSeq = 0; // last input received / acknowledged
+    uint8_t partLen = 0;
+    array<uint8_t,6> part{};    // incomplete client frame
+    // what the client was last told, so only differences are sent
+    int8_t sentX = 0, sentY = 0;
+    uint8_t sentRot = 0, sentGarbage = 0, sentStatus = ST_WAITING;
+    uint32_t mark = 0;          // where this tick's deltas start in out
+    string out;                 // frames not yet taken by the socket
+};
+
+// Spectating. Each watched game has one stream of encoded chunks: a keyframe
+// (snapshot) refreshed every few seconds plus the per-tick delta chunks since.
+// Chunks are encoded once and shared by reference count; every viewer just
+// queues pointers to them and writes them out with writev.
+typedef shared_ptr<const string> Chunk;
+
+const int KEYFRAME_TICKS = 2 * TICK_HZ;
+const size_t VIEWER_BACKLOG = 16384; // queued bytes before a viewer is skipped ahead
+
+struct Stream{
+    Chunk keyframe;
+    vector<Chunk> since;  // delta chunks after the keyframe
+    vector<int> viewers;  // spectator slots
+    int age = 0;          // ticks since the keyframe
+};
+
+struct Viewer{
+    int watching = -1;
+    deque<Chunk> queue;
+    size_t offset = 0;    // bytes of queue.front() already written
+    size_t bytes = 0;     // unwritten bytes in queue
+};
+
+// Server dashboard (--dashboard K): the server's terminal tiles K of the games
+// in progress. The epoll thread samples at most DASH_HZ times a second and
+// copies a game into its tile only when it changed since the last sample. The
+// copy goes through a triple buffer, so the tick loop never waits on the
+// dashboard or the terminal. The dashboard thread redraws only tiles holding
+// a new sample, and the diff encoder sends only the cells that changed.
+const int DASH_HZ = 10, MAX_DASH_TILES = 16;
+
+struct TileSample{
+    Game game;
+    int slot = -1;
+    uint8_t status = ST_WAITING;
+};
+
+struct DashTile{
+    TripleBuffer<TileSample> samples;
+    int slot = -1;              // server thread: the game shown and what it looked like when last sent
+    Game last;
+    uint8_t lastStatus = ST_WAITING;
+    Frame cells;                // dashboard thread: the tile as drawn
+};
+
+struct Dashboard{
+    deque<DashTile> tiles;
+    atomic<int> sessions{0}, matches{0};
+    int cursor = 0; // server thread: where the search for games to show resumes
+};
+
+struct Server{
+    int listenFd = -1, epfd = -1;
+    vector<Game> games;
+    vector<Conn> conns;
+    vector<int> freeSlots;
+    int waiting = -1; // slot waiting for an opponent
+    int sessions = 0, matches = 0;
+    unordered_map<int,Stream> streams; // by player slot
+    unordered_map<int,Viewer> viewers; // by spectator slot
+    ScoreWriter *scores = nullptr;     // every finished match's two games; null if the log cannot be opened
+};
+
+const uint64_t LISTEN_TAG = ~0ULL;
+
+void watch(Server &sv, int slot, bool wantWrite){
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | (wantWrite ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.u64 = slot;
+    epoll_ctl(sv.epfd, EPOLL_CTL_MOD, sv.conns[slot].fd, &ev);
+}
+
+void closeConn(Server &sv, int slot);
+
+void detachViewer(Server &sv, int slot){
+    auto it = sv.viewers.find(slot);
+    if(it == sv.viewers.end()) return;
+    auto st = sv.streams.find(it->second.watching);
+    if(st != sv.streams.end()){
+        auto &v = st->second.viewers;
+        v.erase(find(v.begin(), v.end(), slot));
+        if(v.empty()){
+            sv.conns[st->first].watched = false;
+            sv.streams.erase(st);
+        }
+    }
+    sv.viewers.erase(it);
+}
+
+void closeConn(Server &sv, int slot){
+    Conn &c = sv.conns[slot];
+    if(c.fd < 0) return;
+    epoll_ctl(sv.epfd, EPOLL_CTL_DEL, c.fd, nullptr);
+    close(c.fd);
+    c.fd = -1;
+    if(c.role == ROLE_SPECTATOR) detachViewer(sv, slot);
+    if(c.watched){
+        // the game is gone; so are its spectators
+        vector<int> vs = sv.streams[slot].viewers;
+        for(int v : vs) closeConn(sv, v);
+    }
+    if(sv.waiting == slot) sv.waiting = -1;
+    if(c.opponent >= 0){
+        Conn &o = sv.conns[c.opponent];
+        if(o.status == ST_PLAYING) o.status = ST_WON;
+        o.opponent = -1;
+        if(c.status == ST_PLAYING){ sv.matches--; metricAdd(MET_GAMES_FINISHED, 2); }
+    }
+    sv.conns[slot] = Conn();
+    sv.freeSlots.push_back(slot);
+    sv.sessions--;
+}
+
+// Write queued frames; on a full socket wait for EPOLLOUT. Clients that fall
+// too far behind are dropped.
+void flushConn(Server &sv, int slot){
+    Conn &c = sv.conns[slot];
+    size_t done = 0;
+    while(done < c.out.size()){
+        ssize_t n = send(c.fd, c.out.data() + done, c.out.size() - done, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno != EAGAIN){ closeConn(sv, slot); return; }
+            break;
+        }
+        done += n;
+    }
+    c.out.erase(0, done);
+    metricAdd(MET_NET_BYTES, done);
+    if(c.out.size() > MAX_BACKLOG){ closeConn(sv, slot); return; }
+    bool blocked = !c.out.empty();
+    if(blocked != c.writeBlocked){ c.writeBlocked = blocked; watch(sv, slot, blocked); }
+}
+
+// Write a viewer's queued chunks straight from the shared buffers.
+void flushViewer(Server &sv, int slot){
+    Conn &c = sv.conns[slot];
+    Viewer &v = sv.viewers[slot];
+    while(!v.queue.empty()){
+        iovec iov[64];
+        int n = 0;
+        for(auto it = v.queue.begin(); it != v.queue.end() && n < 64; ++it, ++n){
+            size_t skip = n == 0 ? v.offset : 0;
+            iov[n].iov_base = (void*)((*it)->data() + skip);
+            iov[n].iov_len = (*it)->size() - skip;
+        }
+        ssize_t w = writev(c.fd, iov, n);
+        if(w < 0){
+            if(errno != EAGAIN){ closeConn(sv, slot); return; }
+            break;
+        }
+        v.bytes -= w;
+        metricAdd(MET_NET_BYTES, w);
+        size_t left = w + v.offset;
+        while(!v.queue.empty() && left >= v.queue.front()->size()){
+            left -= v.queue.front()->size();
+            v.queue.pop_front();
+        }
+        v.offset = left;
+    }
+    bool blocked = !v.queue.empty();
+    if(blocked != c.writeBlocked){ c.writeBlocked = blocked; watch(sv, slot, blocked); }
+}
+
+void pushChunk(Viewer &v, const Chunk &ch){
+    v.queue.push_back(ch);
+    v.bytes += ch->size();
+}
+
+// Start (or restart) a viewer from the stream's latest keyframe. A partly
+// written chunk is finished first so the byte stream stays well formed.
+void restartViewer(Viewer &v, const Stream &st){
+    if(!v.queue.empty()){
+        Chunk partial = v.offset ? v.queue.front() : nullptr;
+        v.queue.clear();
+        v.bytes = 0;
+        if(partial){ v.queue.push_back(partial); v.bytes = partial->size() - v.offset; }
+        else v.offset = 0;
+    }
+    pushChunk(v, st.keyframe);
+    for(const Chunk &ch : st.since) pushChunk(v, ch);
+}
+
+Chunk snapshotChunk(const Game &g, int status){
+    string s;
+    putFrame(s, MSG_SNAPSHOT, [&](Writer &w){ encodeSnapshot(w, g, status); });
+    return make_shared<const string>(move(s));
+}
+
+void addViewer(Server &sv, int slot, int target){
+    // watch the requested player, or any game in progress
+    if(target < 0 || target >= (int)sv.conns.size() || sv.conns[target].role != ROLE_PLAYER || sv.conns[target].status != ST_PLAYING){
+        target = -1;
+        for(size_t i=0;i<sv.conns.size() && target<0;++i)
+            if(sv.conns[i].role == ROLE_PLAYER && sv.conns[i].status == ST_PLAYING) target = (int)i;
+    }
+    if(target < 0){ closeConn(sv, slot); return; }
+    Conn &p = sv.conns[target];
+    Stream &st = sv.streams[target];
+    if(!p.watched){
+        p.watched = true;
+        st.keyframe = snapshotChunk(sv.games[target], p.status);
+        st.age = 0;
+    }
+    st.viewers.push_back(slot);
+    Viewer &v = sv.viewers[slot];
+    v.watching = target;
+    restartViewer(v, st);
+    flushViewer(sv, slot);
+}
+
+void queueSnapshot(Conn &c, const Game &g){
+    putFrame(c.out, MSG_SNAPSHOT, [&](Writer &w){ encodeSnapshot(w, g, c.status); });
+    c.sentX = g.curX; c.sentY = g.curY; c.sentRot = g.curRot;
+    c.sentGarbage = (uint8_t)min(g.garbage.total, 255); c.sentStatus = c.status;
+    c.wantSnapshot = false;
+}
+
+// Turn a lock or hold that just happened into an event frame. Afterwards the
+// client's piece sits at the spawn point, exactly where the server's is.
+void queueEvents(Conn &c, const Game &g, uint32_t piecesBefore, int holdBefore, bool canHoldBefore){
+    if(g.pieces != piecesBefore){
+        const LockInfo &lk = g.lastLock;
+        putFrame(c.out, MSG_LOCK, [&](Writer &w){
+            w.u8(lk.id | lk.rot << 4); w.u8(lk.x); w.u8(lk.y); w.u24(lk.clearedMask);
+            w.u8(g.queue.peek(NET_PREVIEW-1)); w.u16(boardHash(g));
+            w.u8(lk.garbageBatches);
+            for(int i=0;i<lk.garbageBatches;++i){ w.u8(lk.garbageRows[i]); w.u8(lk.garbageHole[i]); }
+        });
+    } else if(g.holdId != holdBefore || (canHoldBefore && !g.canHold)){
+        putFrame(c.out, MSG_HOLD, [&](Writer &w){
+            w.u8(g.holdId); w.u8(g.curPieceId);
+            w.u8(holdBefore < 0 ? g.queue.peek(NET_PREVIEW-1) : NO_PIECE);
+        });
+    } else return;
+    c.sentX = g.curX; c.sentY = g.curY; c.sentRot = g.curRot;
+}
+
+// Position, garbage and status changes not already described by an event.
+void queueDeltas(Conn &c, const Game &g){
+    if(c.status == ST_PLAYING && (g.curX != c.sentX || g.curY != c.sentY || g.curRot != c.sentRot)){
+        putFrame(c.out, MSG_MOVE, [&](Writer &w){ w.u8(g.curX); w.u8(g.curY); w.u8(g.curRot); });
+        c.sentX = g.curX; c.sentY = g.curY; c.sentRot = g.curRot;
+    }
+    int pending = min(g.garbage.total, 255);
+    if(pending != c.sentGarbage){
+        putFrame(c.out, MSG_GARBAGE, [&](Writer &w){ w.u8(pending); });
+        c.sentGarbage = (uint8_t)pending;
+    }
+    if(c.status != c.sentStatus){
+        putFrame(c.out, MSG_STATUS, [&](Writer &w){ w.u8(c.status); });
+        c.sentStatus = c.status;
+    }
+}
+
+// Pair a new player with the one waiting, or make it wait. Both players of a
+// match share a seed, so they get the same pieces.
+void matchmake(Server &sv, int slot){
+    if(sv.waiting < 0){
+        sv.waiting = slot;
+        newGame(sv.games[slot], 0); // placeholder board until the match starts
+        sv.conns[slot].wantSnapshot = true;
+        return;
+    }
+    int other = sv.waiting;
+    sv.waiting = -1;
+    uint64_t seed = (uint64_t)chrono::steady_clock::now().time_since_epoch().count() ^ ((uint64_t)slot << 32);
+    for(int s : {slot, other}){
+        newGame(sv.games[s], seed);
+        sv.conns[s].status = ST_PLAYING;
+        sv.conns[s].wantSnapshot = true;
+    }
+    sv.conns[slot].opponent = other;
+    sv.conns[other].opponent = slot;
+    sv.matches++;
+    metricAdd(MET_GAMES_STARTED, 2);
+}
+
+void acceptConns(Server &sv){
+    while(true){
+        int fd = accept4(sv.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return;
+        setNoDelay(fd);
+        int slot;
+        if(!sv.freeSlots.empty()){ slot = sv.freeSlots.back(); sv.freeSlots.pop_back(); }
+        else { slot = (int)sv.conns.size(); sv.conns.emplace_back(); sv.games.emplace_back(); }
+        sv.conns[slot].fd = fd;
+        sv.sessions++;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = slot;
+        epoll_ctl(sv.epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void handleClientMsg(Server &sv, int slot, int type, const uint8_t *payload, int len){
+    Conn &c = sv.conns[slot];
+    if(c.role == ROLE_NEW){
+        if(type == MSG_PLAY){ c.role = ROLE_PLAYER; matchmake(sv, slot); }
+        else if(type == MSG_SPECTATE){
+            c.role = ROLE_SPECTATOR;
+            Reader rd{payload, payload + len};
+            int target = (int)rd.u32();
+            addViewer(sv, slot, rd.ok ? target : -1);
+        }
+        return;
+    }
+    if(c.role == ROLE_SPECTATOR){
+        if(type == MSG_RESYNC){
+            Viewer &v = sv.viewers[slot];
+            restartViewer(v, sv.streams[v.watching]);
+        }
+        return;
+    }
+    if(type == MSG_INPUT && len >= 3){
+        // inputs beyond the per-tick limit, or sent outside a match (keys on the
+        // waiting screen), are dropped but still acknowledged; the client's
+        // rollback then undoes its prediction of them
+        c.lastSeq = (uint16_t)(payload[0] | payload[1] << 8);
+        int act = payload[2];
+        if(c.status == ST_PLAYING && act > ACT_NONE && act < ACT_COUNT && c.inCount < c.inputs.size()) c.inputs[c.inCount++] = (uint8_t)act;
+    } else if(type == MSG_RESYNC) c.wantSnapshot = true;
+}
+
+void readConn(Server &sv, int slot){
+    uint8_t buf[512];
+    while(true){
+        ssize_t n = recv(sv.conns[slot].fd, buf, sizeof buf, 0);
+        if(n == 0 || (n < 0 && errno != EAGAIN)){ closeConn(sv, slot); return; }
+        if(n < 0) return;
+        for(ssize_t i=0;i<n;++i){
+            Conn &c = sv.conns[slot];
+            if(c.fd < 0) return;
+            c.part[c.partLen++] = buf[i];
+            if(c.partLen < 2) continue;
+            int len = c.part[1];
+            if(len > (int)c.part.size() - 2){ closeConn(sv, slot); return; } // not a client frame
+            if(c.partLen == 2 + len){
+                c.partLen = 0;
+                handleClientMsg(sv, slot, c.part[0], c.part.data() + 2, len);
+            }
+        }
+    }
+}
+
+// Hand this tick's delta bytes of a watched game to its viewers (one shared
+// chunk), refreshing the keyframe every KEYFRAME_TICKS.
+void publishTick(Server &sv, int slot){
+    Conn &c = sv.conns[slot];
+    Stream &st = sv.streams[slot];
+    if(c.out.size() > c.mark){
+        Chunk ch = make_shared<const string>(c.out, c.mark);
+        st.since.push_back(ch);
+        for(int v : st.viewers){
+            Viewer &vw = sv.viewers[v];
+            if(vw.bytes > VIEWER_BACKLOG) restartViewer(vw, st); // too slow: skip to the keyframe
+            else pushChunk(vw, ch);
+        }
+    }
+    if(++st.age >= KEYFRAME_TICKS){
+        st.keyframe = snapshotChunk(sv.games[slot], c.status);
+        st.since.clear();
+        st.age = 0;
+    }
+    vector<int> viewers = st.viewers; // a failed write closes the viewer and may drop the stream
+    for(int v : viewers)
+        if(sv.conns[v].fd >= 0 && !sv.conns[v].writeBlocked) flushViewer(sv, v);
+}
+
+// One fixed-rate step of every running game: queued inputs and gravity (with
+// locks and holds reported as they happen), garbage routing, results, then
+// position/garbage/status deltas and one flush per connection.
+void serverTick(Server &sv){
+    TRACE_SPAN("server tick");
+    size_t n = sv.conns.size();
+    for(size_t i=0;i<n;++i){
+        Conn &c = sv.conns[i];
+        c.mark = (uint32_t)c.out.size();
+        if(c.status != ST_PLAYING) continue;
+        Game &g = sv.games[i];
+        GameTotals before = totalsOf(g);
+        for(int k=0;k<=c.inCount;++k){
+            uint32_t pieces = g.pieces;
+            int hold = g.holdId;
+            bool canHold = g.canHold;
+            if(k < c.inCount) applyAction(g, c.inputs[k]);
+            else tickGame(g);
+            queueEvents(c, g, pieces, hold, canHold);
+        }
+        c.inCount = 0;
+        countProgress(before, g);
+        if(g.attackOut){
+            if(c.opponent >= 0) addGarbage(sv.games[c.opponent], g.attackOut);
+            g.attackOut = 0;
+        }
+    }
+    for(size_t i=0;i<n;++i){
+        Conn &c = sv.conns[i];
+        if(c.status != ST_PLAYING || !sv.games[i].gameOver) continue;
+        c.status = ST_LOST;
+        if(c.opponent >= 0 && sv.conns[c.opponent].status == ST_PLAYING) sv.conns[c.opponent].status = ST_WON;
+        sv.matches--;
+        metricAdd(MET_GAMES_FINISHED, 2);
+        if(sv.scores){
+            queueScore(*sv.scores, makeScoreRecord(sv.games[i], "versus"));
+            if(c.opponent >= 0) queueScore(*sv.scores, makeScoreRecord(sv.games[c.opponent], "versus"));
+        }
+    }
+    for(size_t i=0;i<n;++i){
+        Conn &c = sv.conns[i];
+        if(c.fd < 0 || c.role != ROLE_PLAYER) continue;
+        const Game &g = sv.games[i];
+        queueDeltas(c, g);
+        if(c.watched) publishTick(sv, (int)i);
+        if(c.wantSnapshot){
+            c.out.resize(c.mark); // the snapshot already includes this tick
+            queueSnapshot(c, g);
+        }
+        if(c.lastSeq != c.sentSeq){
+            putFrame(c.out, MSG_ACK, [&](Writer &w){ w.u16(c.lastSeq); });
+            c.sentSeq = c.lastSeq;
+        }
+        if(!c.out.empty() && !c.writeBlocked) flushConn(sv, (int)i);
+    }
+}
+
+// Point tiles whose game ended at other games in progress, and publish the
+// games that changed since the last sample.
+void sampleDashboard(Server &sv, Dashboard &d){
+    d.sessions.store(sv.sessions, memory_order_relaxed);
+    d.matches.store(sv.matches, memory_order_relaxed);
+    int n = (int)sv.conns.size();
+    auto playing = [&](int slot){
+        const Conn &c = sv.conns[slot];
+        return c.fd >= 0 && c.role == ROLE_PLAYER && c.status == ST_PLAYING;
+    };
+    auto shown = [&](int slot){
+        for(DashTile &t : d.tiles) if(t.slot == slot) return true;
+        return false;
+    };
+    for(DashTile &t : d.tiles){
+        bool moved = false;
+        if(t.slot < 0 || !playing(t.slot)){
+            for(int k=0;k<n;++k){
+                int slot = (d.cursor + k) % n;
+                if(!playing(slot) || shown(slot)) continue;
+                t.slot = slot;
+                d.cursor = slot + 1;
+                moved = true;
+                break;
+            }
+        }
+        if(t.slot < 0) continue;
+        const Game &g = sv.games[t.slot];
+        uint8_t status = sv.conns[t.slot].status;
+        t.last.fallTimer = g.fallTimer; // counts every tick but is never drawn
+        if(!moved && status == t.lastStatus && !memcmp((const void*)&t.last, (const void*)&g, sizeof g)) continue;
+        t.last = g;
+        t.lastStatus = status;
+        TileSample &s = t.samples.writeSlot();
+        s.game = g;
+        s.slot = t.slot;
+        s.status = status;
+        t.samples.publish();
+    }
+}
+
+void drawTile(Frame &cells, const TileSample &s){
+    cells.clear();
+    char title[32];
+    snprintf(title, sizeof title, "#%d %lld%s", s.slot, s.game.score, s.status == ST_PLAYING ? "" : " end");
+    appendText(cells.addLine(), string_view(title).substr(0, boardCols()+2));
+    uint8_t px[BOARD_H][BOARD_W];
+    boardPixels(s.game, false, px);
+    for(int i=0;i<boardRows()+2;++i){
+        boardLine(cells.addLine(), px, i, Cell{});
+    }
+}
+
+void dashboardLoop(Dashboard &d){
+    using clk = chrono::steady_clock;
+    TermOut term;
+    Frame frame;
+    setOutputBlocking(false);
+    int tileW = boardCols() + 2, tileH = boardRows() + 3, across = 1;
+    watchResize();
+    auto next = clk::now();
+    while(true){
+        next += chrono::milliseconds(1000 / DASH_HZ);
+        bool changed = false;
+        if(takeResize()){
+            int rows, cols;
+            terminalSize(rows, cols);
+            across = max(1, (cols + 2) / (tileW + 2));
+            setViewport(term, 0, 0, rows, cols);
+            changed = true;
+        }
+        for(DashTile &t : d.tiles) if(TileSample *s = t.samples.takeLatest()){ drawTile(t.cells, *s); changed = true; }
+        if(changed){
+            int count = (int)d.tiles.size();
+            for(int first=0;first<count;first+=across){
+                for(int line=0;line<tileH;++line){
+                    vector<Cell> &row = frame.addLine();
+                    for(int k=first;k<min(count, first+across);++k){
+                        const Frame &cells = d.tiles[k].cells;
+                        if(line < (int)cells.size()) row.insert(row.end(), cells[line].begin(), cells[line].end());
+                        row.resize((k - first + 1) * (tileW + 2), Cell{});
+                    }
+                }
+            }
+            char footer[96];
+            snprintf(footer, sizeof footer, "sessions %d  matches %d",
+                     d.sessions.load(memory_order_relaxed), d.matches.load(memory_order_relaxed));
+            frameText(frame, footer);
+            submitFrame(term, frame);
+        }
+        while(pumpTerm(term)){
+            int ms = (int)chrono::duration_cast<chrono::milliseconds>(next - clk::now()).count();
+            if(ms <= 0) break;
+            pollfd pfd = {STDOUT_FILENO, POLLOUT, 0};
+            poll(&pfd, 1, ms);
+        }
+        this_thread::sleep_until(next);
+    }
+}
+
+int runServer(const string &addr, int dashTiles){
+    SockAddr a;
+    if(!parseAddr(addr, a)){ cerr << "bad address: " << addr << "\n"; return 1; }
+    if(a.ss.ss_family == AF_UNIX) unlink(((sockaddr_un*)&a.ss)->sun_path);
+    Server sv;
+    sv.listenFd = socket(a.ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(sv.listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if(sv.listenFd < 0 || ::bind(sv.listenFd, (sockaddr*)&a.ss, a.len) < 0 || listen(sv.listenFd, 4096) < 0){
+        perror("listen");
+        return 1;
+    }
+    sv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_TAG;
+    epoll_ctl(sv.epfd, EPOLL_CTL_ADD, sv.listenFd, &ev);
+    cerr << "tetris server listening on " << addr << "\n";
+    sv.scores = new ScoreWriter(); // runs until the process exits
+    if(openScores(sv.scores->sb, scoresPath)) thread(scoreWriterLoop, ref(*sv.scores)).detach();
+    else {
+        cerr << "high scores disabled: cannot open " << scoresPath << "\n";
+        delete sv.scores;
+        sv.scores = nullptr;
+    }
+    Dashboard *dash = nullptr;
+    if(dashTiles > 0){
+        dash = new Dashboard(); // runs until the process exits
+        for(int k=0;k<min(dashTiles, MAX_DASH_TILES);++k) dash->tiles.emplace_back();
+        if(blockMode == BLOCK_NONE) blockMode = BLOCK_HALF;
+        thread(dashboardLoop, ref(*dash)).detach();
+    }
+    deliverResize(true); // interrupts epoll_wait; the dashboard polls the flag
+
+    using clk = chrono::steady_clock;
+    const auto tickLen = chrono::nanoseconds(1000000000 / TICK_HZ);
+    auto nextTick = clk::now() + tickLen;
+    auto nextReport = clk::now() + chrono::seconds(5), nextSample = clk::now();
+    epoll_event evs[256];
+    while(true){
+        auto now = clk::now();
+        int timeout = nextTick > now ? (int)chrono::duration_cast<chrono::milliseconds>(nextTick - now).count() : 0;
+        int n = epoll_wait(sv.epfd, evs, 256, timeout);
+        if(n < 0 && errno != EINTR){ perror("epoll_wait"); return 1; }
+        for(int i=0;i<n;++i){
+            if(evs[i].data.u64 == LISTEN_TAG){ acceptConns(sv); continue; }
+            int slot = (int)evs[i].data.u64;
+            if(sv.conns[slot].fd < 0) continue; // closed earlier in this batch
+            if(evs[i].events & (EPOLLERR | EPOLLHUP)){ closeConn(sv, slot); continue; }
+            if(evs[i].events & EPOLLOUT){
+                if(sv.conns[slot].role == ROLE_SPECTATOR) flushViewer(sv, slot);
+                else flushConn(sv, slot);
+            }
+            if(sv.conns[slot].fd >= 0 && (evs[i].events & (EPOLLIN | EPOLLRDHUP))) readConn(sv, slot);
+        }
+        now = clk::now();
+        if(now - nextTick > chrono::seconds(1)) nextTick = now; // overloaded: drop ticks, don't spiral
+        while(now >= nextTick){
+            serverTick(sv);
+            nextTick += tickLen;
+        }
+        TRACE_POLL();
+        if(dash && now >= nextSample){
+            sampleDashboard(sv, *dash);
+            nextSample = now + chrono::milliseconds(1000 / DASH_HZ);
+        }
+        if(!dash && now >= nextReport){ // the dashboard shows these itself
+            cerr << "sessions " << sv.sessions << "  matches " << sv.matches
+                 << "  spectators " << sv.viewers.size() << "\n";
+            nextReport = now + chrono::seconds(5);
+        }
+    }
+}
+
+void sendInput(int fd, uint16_t seq, int act){
+    uint8_t msg[5] = {MSG_INPUT, 3, (uint8_t)(seq & 0xFF), (uint8_t)(seq >> 8), (uint8_t)act};
+    send(fd, msg, sizeof msg, MSG_NOSIGNAL);
+}
+
+void sendResync(int fd){
+    uint8_t msg[2] = {MSG_RESYNC, 0};
+    send(fd, msg, sizeof msg, MSG_NOSIGNAL);
+}
+
+// Apply one server frame to the client's confirmed copy of the game. Returns
+// false when the copy can no longer be trusted and a resync is needed.
+bool applyServerFrame(Game &g, int &incoming, int type, Reader &rd){
+    if(type == MSG_MOVE){
+        g.curX = rd.i8(); g.curY = rd.i8(); g.curRot = rd.u8() & 3;
+        updateGhost(g);
+    } else if(type == MSG_LOCK){
+        LockInfo lk;
+        int idRot = rd.u8();
+        lk.id = idRot & 0x0F; lk.rot = (idRot >> 4) & 3;
+        lk.x = rd.i8(); lk.y = rd.i8(); lk.clearedMask = rd.u24();
+        int reveal = rd.u8();
+        unsigned hash = rd.u16();
+        lk.garbageBatches = rd.u8();
+        if(lk.garbageBatches > lk.garbageRows.size()) return false;
+        for(int i=0;i<lk.garbageBatches;++i){ lk.garbageRows[i] = rd.u8(); lk.garbageHole[i] = rd.u8() % BOARD_W; }
+        if(!rd.ok || lk.id >= 7) return false;
+        replayLock(g, lk, reveal);
+        return boardHash(g) == hash;
+    } else if(type == MSG_HOLD){
+        int hold = rd.u8(), cur = rd.u8(), reveal = rd.u8();
+        if(!rd.ok || hold >= 7 || cur >= 7) return false;
+        replayHold(g, hold, cur, reveal);
+    } else if(type == MSG_GARBAGE){
+        incoming = rd.u8();
+    }
+    return rd.ok;
+}
+
+// Inputs sent but not yet acknowledged, oldest first.
+struct PendingInputs{
+    static const int CAP = 64;
+    array<uint16_t,CAP> seq{};
+    array<uint8_t,CAP> act{};
+    int head = 0, count = 0;
+
+    bool full() const { return count == CAP; }
+    void push(uint16_t s, int a){ int i = (head+count++) % CAP; seq[i] = s; act[i] = (uint8_t)a; }
+    // drop everything up to and including sequence number s (wrapping compare)
+    void ack(uint16_t s){
+        while(count && (int16_t)(s - seq[head]) >= 0){ head = (head+1) % CAP; count--; }
+    }
+};
+
+void sendSpectate(int fd, int target){
+    uint8_t msg[6] = {MSG_SPECTATE, 4};
+    Writer w{msg + 2};
+    w.u32((uint32_t)target);
+    send(fd, msg, sizeof msg, MSG_NOSIGNAL);
+}
+
+void sendPlay(int fd){
+    uint8_t msg[2] = {MSG_PLAY, 0};
+    send(fd, msg, sizeof msg, MSG_NOSIGNAL);
+}
+
+// Interactive terminal client. Keys are applied to a predicted game at once
+// and sent to the server; server frames update the confirmed game, and the
+// prediction is rebuilt from it by replaying the inputs still in flight.
+// Spectators (spectate >= -1) only draw the confirmed game they are sent.
+int runClient(const string &addr, int spectate){
+    SockAddr a;
+    int fd = parseAddr(addr, a) ? connectTo(a, false) : -1;
+    if(fd < 0){ cerr << "cannot connect to " << addr << "\n"; return 1; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    bool spectator = spectate >= -1;
+    if(spectator) sendSpectate(fd, spectate);
+    else sendPlay(fd);
+    previewCount = min(previewCount, NET_PREVIEW);
+    initTerminal();
+    hideCursor();
+
+    Game confirmed, predicted;
+    PendingInputs pending;
+    uint16_t nextSeq = 0;
+    int status = ST_WAITING, incoming = 0;
+    bool synced = false, redraw = false, quit = false;
+    string in;
+    AutoShift autoShift;
+    TermOut term;
+    Frame screen;
+    cout.flush();
+    setOutputBlocking(false);
+    watchResize();
+    deliverResize(true);
+    const auto tickLen = chrono::nanoseconds(1000000000 / TICK_HZ);
+    auto lastTick = chrono::steady_clock::now();
+    auto act = [&](int a){
+        if(a == ACT_NONE || spectator) return;
+        sendInput(fd, ++nextSeq, a);
+        if(synced && status == ST_PLAYING && !pending.full()){
+            pending.push(nextSeq, a);
+            applyAction(predicted, a);
+            redraw = true;
+        }
+    };
+    while(!quit && status != ST_WON && status != ST_LOST){
+        int ch;
+        while((ch = readKey()) != -1){
+            int shift = autoShiftKey(autoShift, ch, inputNowMs());
+            if(shift >= 0){ act(shift); continue; }
+            if(ch & KEY_RELEASE) continue;
+            if(ch=='q' || ch=='Q' || ch==3){ quit = true; break; }
+            if(ch=='g' || ch=='G'){ showGhost = !showGhost; redraw = true; continue; }
+            act(keyAction(ch));
+        }
+        // auto-repeat runs on the same tick rate as the server's simulation
+        if(!autoShiftActive(autoShift)) lastTick = max(lastTick, chrono::steady_clock::now() - tickLen); // idle: no backlog
+        for(auto now = chrono::steady_clock::now(); now - lastTick >= tickLen; lastTick += tickLen){
+            if(!synced || status != ST_PLAYING) continue;
+            int acts[2];
+            int n = autoShiftTick(autoShift, predicted, inputNowMs(), input.kitty, acts);
+            for(int i=0;i<n;++i) act(acts[i]);
+        }
+        char buf[4096];
+        ssize_t n;
+        while((n = recv(fd, buf, sizeof buf, 0)) > 0) in.append(buf, n);
+        if(n == 0){ quit = true; }
+        bool moved = false;
+        drainFrames(in, [&](int type, Reader &rd){
+            moved = true;
+            if(type == MSG_SNAPSHOT){ synced = decodeSnapshot(rd, confirmed, status, incoming); return; }
+            if(type == MSG_STATUS){ status = rd.u8(); return; }
+            if(type == MSG_ACK){ pending.ack((uint16_t)rd.u16()); return; }
+            if(!synced) return; // deltas before the resync snapshot are stale
+            if(!applyServerFrame(confirmed, incoming, type, rd)){ synced = false; sendResync(fd); }
+        });
+        if(moved){
+            // roll back to the confirmed state and re-simulate unacknowledged inputs
+            predicted = confirmed;
+            for(int i=0;i<pending.count;++i) applyAction(predicted, pending.act[(pending.head+i) % PendingInputs::CAP]);
+            redraw = true;
+        }
+        if(updateLayout()){
+            setViewport(term, layout.top, layout.left, layout.rows, layout.cols);
+            redraw = true;
+        }
+        if(redraw){
+            if(synced && status != ST_WAITING) drawGame(screen, predicted);
+            if(status == ST_WAITING) frameText(screen, "Waiting for an opponent...");
+            else frameText(screen, (spectator ? "Spectating.  Incoming garbage: " : "Incoming garbage: ") + to_string(incoming));
+            submitFrame(term, screen);
+            redraw = false;
+        }
+        bool busy = pumpTerm(term); // a slow terminal drops frames instead of stalling the connection
+        // idle policy: sleep until input, a server frame or terminal space; wake
+        // on a timer only while a held key repeats or an ESC is unresolved
+        int timeout = inputTimeout();
+        if(autoShiftActive(autoShift)){
+            auto untilTick = lastTick + tickLen - chrono::steady_clock::now();
+            int ms = max(0, (int)chrono::duration_cast<chrono::milliseconds>(untilTick + chrono::microseconds(999)).count());
+            timeout = timeout >= 0 ? min(timeout, ms) : ms;
+        }
+        pollfd pfd[3] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}, {STDOUT_FILENO, POLLOUT, 0}};
+        poll(pfd, busy ? 3 : 2, timeout);
+        TRACE_POLL();
+    }
+    drainTerm(term);
+    if(spectator && (status == ST_WON || status == ST_LOST))
+        cout << "Player " << (status == ST_WON ? "won" : "lost") << ". Final Score: " << confirmed.score << "\n";
+    else if(status == ST_WON) cout << "YOU WIN! Final Score: " << confirmed.score << "\n";
+    else if(status == ST_LOST) cout << "YOU LOSE! Final Score: " << confirmed.score << "\n";
+    showCursor();
+    restoreTerminal();
+    close(fd);
+    return 0;
+}
+
+// Loopback load generator: N bots that connect, press random keys a few times
+// a second and reconnect when their match ends, plus optional spectator bots
+// watching whichever matches the server picks. Prints throughput each second.
+int runLoadTest(const string &addr, int players, int spectators, int seconds){
+    SockAddr a;
+    if(!parseAddr(addr, a)){ cerr << "bad address: " << addr << "\n"; return 1; }
+    struct Bot{ int fd = -1; string in; int64_t nextInput = 0; };
+    int clients = players + spectators;
+    vector<Bot> bots(clients);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    uint64_t rng = 12345;
+    using clk = chrono::steady_clock;
+    auto t0 = clk::now();
+    auto ms = [&]{ return (int64_t)chrono::duration_cast<chrono::milliseconds>(clk::now() - t0).count(); };
+    auto open = [&](int i){
+        bots[i] = Bot();
+        bots[i].fd = connectTo(a, true);
+        bots[i].nextInput = ms() + (int64_t)(nextRandom(rng) % 200);
+        if(bots[i].fd < 0) return;
+        if(i < players) sendPlay(bots[i].fd);
+        else sendSpectate(bots[i].fd, -1);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, bots[i].fd, &ev);
+    };
+    auto reopen = [&](int i){
+        if(bots[i].fd >= 0) close(bots[i].fd);
+        open(i);
+    };
+    for(int i=0;i<clients;++i) open(i);
+
+    long long bytes = 0, frames = 0, finished = 0, inputs = 0;
+    int64_t nextReport = 1000;
+    vector<epoll_event> evs(1024);
+    while(ms() < seconds * 1000LL){
+        int n = epoll_wait(ep, evs.data(), (int)evs.size(), 5);
+        for(int k=0;k<n;++k){
+            int i = (int)evs[k].data.u64;
+            char buf[4096];
+            ssize_t r;
+            while((r = recv(bots[i].fd, buf, sizeof buf, 0)) > 0){ bots[i].in.append(buf, r); bytes += r; }
+            bool done = r == 0 || (r < 0 && errno != EAGAIN);
+            drainFrames(bots[i].in, [&](int type, Reader &rd){
+                frames++;
+                if(type == MSG_STATUS || type == MSG_SNAPSHOT){
+                    int st = rd.u8();
+                    if(st == ST_WON || st == ST_LOST) done = true;
+                }
+            });
+            if(done){ finished++; reopen(i); }
+        }
+        int64_t now = ms();
+        for(int i=0;i<players;++i){
+            if(bots[i].fd < 0 || now < bots[i].nextInput) continue;
+            uint64_t r = nextRandom(rng);
+            sendInput(bots[i].fd, (uint16_t)inputs, (int)(1 + r % (ACT_COUNT - 1)));
+            inputs++;
+            bots[i].nextInput = now + 100 + (int64_t)(r >> 32) % 200;
+        }
+        if(now >= nextReport){
+            cerr << "t=" << now/1000 << "s clients " << clients << "  in " << bytes/1024 << " KiB  frames " << frames
+                 << "  inputs " << inputs << "  finished " << finished << "\n";
+            nextReport += 1000;
+        }
+    }
+    cout << "loadtest: " << players << " players + " << spectators << " spectators, " << seconds << "s, " << frames << " frames, "
+         << bytes << " bytes (" << bytes / max(1, seconds) / max(1, clients) << " B/s per client), "
+         << finished << " finished games\n";
+    return 0;
+}
+#endif
+
+// Metrics export: Prometheus text format, served over HTTP (--metrics ADDR,
+// Linux) and/or rewritten every few seconds to a file (--metrics-file FILE).
+// Rates (pieces or render bytes per second) are rate() over the counters.
+struct MetricDesc{ const char *name, *type, *help; };
+
+const MetricDesc METRIC_DESC[MET_COUNT] = {
+    {"tetris_games_started_total", "counter", "Games started."},
+    {"tetris_games_finished_total", "counter", "Games finished (topped out, won or abandoned)."},
+    {"tetris_pieces_total", "counter", "Pieces placed."},
+    {"tetris_lines_cleared_total", "counter", "Lines cleared (Game::linesCleared)."},
+    {"tetris_score_total", "counter", "Points scored (Game::score)."},
+    {"tetris_levels_gained_total", "counter", "Levels gained (Game::level)."},
+    {"tetris_frames_total", "counter", "Frames drawn by the local game loop."},
+    {"tetris_frame_seconds_total", "counter", "Time spent producing those frames."},
+    {"tetris_render_bytes_total", "counter", "Bytes written to the terminal."},
+    {"tetris_net_bytes_sent_total", "counter", "Bytes sent to network clients."},
+};
+
+const int METRICS_FILE_SECONDS = 5;
+string metricsAddr, metricsPath;
+const auto processStart = chrono::steady_clock::now();
+
+string metricsText(){
+    string out;
+    char line[160];
+    uint64_t v[MET_COUNT];
+    for(int m=0;m<MET_COUNT;++m) v[m] = metricTotal((Metric)m);
+    for(int m=0;m<MET_COUNT;++m){
+        const MetricDesc &d = METRIC_DESC[m];
+        int n = snprintf(line, sizeof line, "# HELP %s %s\n# TYPE %s %s\n%s ", d.name, d.help, d.name, d.type, d.name);
+        if(m == MET_FRAME_NS) snprintf(line + n, sizeof line - n, "%.9f\n", v[m] / 1e9);
+        else snprintf(line + n, sizeof line - n, "%llu\n", (unsigned long long)v[m]);
+        out += line;
+    }
+    auto gauge = [&](const char *name, const char *help, double val){
+        snprintf(line, sizeof line, "# HELP %s %s\n# TYPE %s gauge\n%s %.9g\n", name, help, name, name, val);
+        out += line;
+    };
+    gauge("tetris_games_running", "Games in progress.", (double)(v[MET_GAMES_STARTED] - v[MET_GAMES_FINISHED]));
+    gauge("tetris_frame_seconds_avg", "Average frame time since start.", v[MET_FRAMES] ? v[MET_FRAME_NS] / 1e9 / v[MET_FRAMES] : 0.0);
+    gauge("tetris_uptime_seconds", "Seconds since the process started.",
+          chrono::duration<double>(chrono::steady_clock::now() - processStart).count());
+    return out;
+}
+
+// Write to a temporary file and rename, so readers never see half a file.
+void writeMetricsFile(){
+    string tmp = metricsPath + ".tmp";
+    {
+        ofstream f(tmp, ios::trunc);
+        f << metricsText();
+    }
+    rename(tmp.c_str(), metricsPath.c_str());
+}
+
+#ifdef __linux__
+// Answer every connection with the current metrics; one request each.
+void serveMetrics(int listenFd){
+    while(true){
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if(fd < 0){ if(errno == EINTR) continue; return; }
+        timeval tv{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        char req[1024];
+        (void)!recv(fd, req, sizeof req, 0); // request line and headers; the path is ignored
+        string body = metricsText();
+        string resp = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                      + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for(size_t done = 0; done < resp.size();){
+            ssize_t n = send(fd, resp.data() + done, resp.size() - done, MSG_NOSIGNAL);
+            if(n <= 0) break;
+            done += n;
+        }
+        close(fd);
+    }
+}
+#endif
+
+// Start the exporter threads asked for on the command line. Returns false if
+// the HTTP address cannot be used.
+bool startMetrics(){
+    if(!metricsAddr.empty()){
+#ifdef __linux__
+        SockAddr a;
+        // a bare port stays on this machine
+        if(!parseAddr(metricsAddr, a, "127.0.0.1")){ cerr << "bad metrics address: " << metricsAddr << "\n"; return false; }
+        int fd = socket(a.ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if(fd < 0 || ::bind(fd, (sockaddr*)&a.ss, a.len) < 0 || listen(fd, 16) < 0){ perror("metrics"); return false; }
+        thread(serveMetrics, fd).detach();
+#else
+        cerr << "--metrics needs Linux; use --metrics-file\n";
+        return false;
+#endif
+    }
+    if(!metricsPath.empty()){
+        thread([]{
+            while(true){
+                this_thread::sleep_for(chrono::seconds(METRICS_FILE_SECONDS));
+                writeMetricsFile();
+            }
+        }).detach();
+    }
+    return true;
+}
+
+int main(int argc, char **argv){
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+
+    uint64_t seed = (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+    string serverAddr, connectAddr, savePath = "tetris.sav";
+    int loadClients = 0, loadSpectators = 0, loadSeconds = 10, spectate = -2, dashTiles = 0;
+    bool selfTest = false;
+    const char *colorTerm = getenv("COLORTERM"), *term = getenv("TERM");
+    if(colorTerm && (strstr(colorTerm, "truecolor") || strstr(colorTerm, "24bit"))) colorMode = COLOR_TRUE;
+    else if(term && strstr(term, "256color")) colorMode = COLOR_256;
+    for(int i=1;i<argc;++i){
+        string a = argv[i];
+        if(a=="--preview" && i+1<argc) previewCount = max(0, min(MAX_PREVIEW, atoi(argv[++i])));
+        else if(a=="--seed" && i+1<argc) seed = strtoull(argv[++i], nullptr, 10);
+        else if(a=="--server" && i+1<argc) serverAddr = argv[++i];
+        else if(a=="--connect" && i+1<argc) connectAddr = argv[++i];
+        else if(a=="--loadtest" && i+1<argc) loadClients = atoi(argv[++i]);
+        else if(a=="--duration" && i+1<argc) loadSeconds = atoi(argv[++i]);
+        else if(a=="--spectators" && i+1<argc) loadSpectators = atoi(argv[++i]);
+        else if(a=="--dashboard" && i+1<argc) dashTiles = max(0, atoi(argv[++i]));
+        else if(a=="--spectate" && i+1<argc) spectate = max(-1, atoi(argv[++i]));
+        else if(a=="--stats" && i+1<argc) statsPath = argv[++i];
+        else if(a=="--save" && i+1<argc) savePath = argv[++i];
+        else if(a=="--color" && i+1<argc){
+            string m = argv[++i];
+            colorMode = m=="truecolor" ? COLOR_TRUE : m=="256" ? COLOR_256 : COLOR_NONE;
+        }
+        else if(a=="--blocks" && i+1<argc){
+            string m = argv[++i];
+            blockMode = m=="quad" ? BLOCK_QUAD : m=="half" ? BLOCK_HALF : BLOCK_NONE;
+        }
+        else if(a=="--das" && i+1<argc) dasTicks = max(0, atoi(argv[++i]));
+        else if(a=="--arr" && i+1<argc) arrTicks = max(0, atoi(argv[++i]));
+        else if(a=="--scores" && i+1<argc) scoresPath = argv[++i];
+        else if(a=="--metrics" && i+1<argc) metricsAddr = argv[++i];
+        else if(a=="--metrics-file" && i+1<argc) metricsPath = argv[++i];
+        else if(a=="--selftest") selfTest = true;
+        else if(a=="--record" && i+1<argc) castPath = argv[++i];
+        else if(a=="--trace" && i+1<argc){
+#ifdef TETRIS_TRACE
+            tracePath = argv[++i];
+#else
+            ++i;
+            cerr << "--trace needs a build with -DTETRIS_TRACE; ignored\n";
+#endif
+        }
+        else {
+            cerr << "usage: " << argv[0] << " [--preview N] [--seed S] [--color none|256|truecolor] [--blocks half|quad] [--das F] [--arr F] [--save FILE] [--scores FILE] [--stats FILE] [--trace FILE] [--selftest]\n"
+                 << "       (any mode) [--metrics ADDR] [--metrics-file FILE] [--record FILE]\n"
+                 << "       " << argv[0] << " --server ADDR [--dashboard K]\n"
+                 << "       " << argv[0] << " --connect ADDR [--spectate SLOT]\n"
+                 << "       " << argv[0] << " --connect ADDR --loadtest N [--spectators M] [--duration S]\n"
+                 << "ADDR is PORT, HOST:PORT or unix:PATH\n";
+            return 1;
+        }
+    }
+
+    initPieces();
+    initOriented();
+    initColors();
+    if(selfTest) return runSelfTest();
+#ifdef TETRIS_TRACE
+    if(!tracePath.empty()){
+        atexit(traceWrite);
+#ifdef SIGUSR1
+        signal(SIGUSR1, traceOnSignal);
+#endif
+    }
+#endif
+
+    deliverResize(false); // see deliverResize(): threads started from here on never take SIGWINCH
+    if(!startMetrics()) return 1;
+    if(!castPath.empty() && !startCast()) return 1;
+    static CountingBuf countingOut(cout.rdbuf());
+    if(!metricsAddr.empty() || !metricsPath.empty()) cout.rdbuf(&countingOut);
+
+    if(!serverAddr.empty() || !connectAddr.empty()){
+#ifdef __linux__
+        if(!serverAddr.empty()) return runServer(serverAddr, dashTiles);
+        if(loadClients>0 || loadSpectators>0) return runLoadTest(connectAddr, loadClients, loadSpectators, loadSeconds);
+        return runClient(connectAddr, spectate);
+#else
+        cerr << "network modes need Linux (epoll)\n";
+        return 1;
+#endif
+    }
+
+    initTerminal();
+    hideCursor();
+
+    Game g;
+    bool saved = false;
+    if(!loadGame(savePath, g)) newGame(g, seed);
+#ifndef _WIN32
+    ScoreBoard scores;
+    openScores(scores, scoresPath);
+#endif
+    metricAdd(MET_GAMES_STARTED);
+
+    using clk = chrono::steady_clock;
+    const auto tickLen = chrono::nanoseconds(1000000000 / TICK_HZ);
+    const auto startTime = clk::now();
+    auto lastTick = startTime, lastFrame = startTime;
+    clk::time_point keyTime{}; // earliest key not yet shown on screen
+    uint64_t frameSeq = 0, keySeq = 0; // keySeq: first frame published with keyTime
+    bool paused = false;
+    AutoShift autoShift;
+    auto ns = [](clk::duration d){ return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(d).count(); };
+    Renderer renderer;
+    cout.flush();
+    setOutputBlocking(false);
+    watchResize();
+    renderer.worker = thread(renderLoop, ref(renderer), startTime);
+    deliverResize(true); // a resize wakes this thread's input wait
+    // Idle policy: a frame is published only when something on it changed, and
+    // between frames the loop sleeps in waitInput() until a key or the tick
+    // that moves something (gravity, or auto-shift while a key is held).
+    // Paused, there is no such tick, so an idle game costs no CPU.
+    Game shownGame;
+    bool shownAny = false, shownPaused = false, shownGhost = true;
+    // frameStart: when this loop iteration began; a published frame counts
+    // its time from there into MET_FRAME_NS
+    auto publish = [&](clk::time_point frameStart){
+        if(keySeq && renderer.shownSeq.load(memory_order_acquire) >= keySeq){ keyTime = clk::time_point{}; keySeq = 0; }
+        shownGame.fallTimer = g.fallTimer; // counts every tick but is never drawn
+        bool changed = !shownAny || paused != shownPaused || showGhost != shownGhost || showStats || resizePending
+                    || memcmp((const void*)&g, (const void*)&shownGame, sizeof g);
+        if(!changed){
+            if(!keySeq) keyTime = clk::time_point{}; // the key changed nothing there is to show
+            return;
+        }
+        shownAny = true;
+        shownGame = g;
+        shownPaused = paused;
+        shownGhost = showGhost;
+        FrameSnapshot &s = renderer.frames.writeSlot();
+        s.game = g;
+        s.seq = ++frameSeq;
+        s.paused = paused;
+        s.ghost = showGhost;
+        s.stats = showStats;
+        if(keyTime != clk::time_point{} && !keySeq) keySeq = s.seq;
+        s.keyTime = keyTime;
+        if(showStats || !statsPath.empty()){
+            s.timings.frame = frameStats.frame;
+            s.timings.input = frameStats.input;
+            s.timings.tick = frameStats.tick;
+        }
+        renderer.frames.publish();
+        wakeRenderer(renderer);
+        metricAdd(MET_FRAMES);
+        metricAdd(MET_FRAME_NS, ns(clk::now() - frameStart));
+    };
+
+    while(true){
+    if(g.gameOver) break;
+
+    // input handling (non-blocking)
+    auto frameStart = clk::now();
+    GameTotals before = totalsOf(g);
+    int ch;
+    while((ch = readKey()) != -1){
+        if(keyTime == clk::time_point{}) keyTime = clk::now();
+        int shift = paused ? -1 : autoShiftKey(autoShift, ch, inputNowMs());
+        if(shift >= 0){ applyAction(g, shift); continue; }
+        if(ch & KEY_RELEASE) continue;
+        if(ch=='q' || ch=='Q' || ch==3){ // 3: ctrl+c as the kitty protocol reports it
+            saved = saveGame(savePath, g); // quitting keeps the game for next time
+            g.gameOver = true; break;
+        } else if(ch=='p' || ch=='P'){
+            paused = !paused;
+            autoShift = AutoShift();
+        } else if(ch=='f' || ch=='F'){
+            showStats = !showStats;
+        } else if(!paused){
+            if(ch=='g' || ch=='G') showGhost = !showGhost;
+            else applyAction(g, keyAction(ch));
+        }
+    }
+
+    if(paused){
+        // display paused state once, then sleep until a key (or a resize)
+        keyTime = clk::time_point{};
+        keySeq = 0;
+        publish(frameStart);
+        TRACE_POLL();
+        waitInput(inputTimeout());
+        lastTick = lastFrame = clk::now();
+        continue;
+    }
+
+    // run the fixed-rate ticks that are due (gravity lives in tickGame)
+    auto inputEnd = clk::now();
+    while(inputEnd - lastTick >= tickLen){
+        int acts[2];
+        int n = autoShiftTick(autoShift, g, inputNowMs(), input.kitty, acts);
+        for(int i=0;i<n;++i) applyAction(g, acts[i]);
+        tickGame(g);
+        lastTick += tickLen;
+    }
+
+    auto tickEnd = clk::now();
+    countProgress(before, g);
+    FrameStats &fs = frameStats;
+    fs.frame.record(ns(frameStart - lastFrame));
+    fs.input.record(ns(inputEnd - frameStart));
+    fs.tick.record(ns(tickEnd - inputEnd));
+    publish(frameStart); // drawing and the terminal write happen on the render thread
+    lastFrame = frameStart;
+    TRACE_POLL();
+    // sleep until a tick that can change the picture is due or a key arrives
+    int ticks = autoShiftActive(autoShift) ? 1 : max(1, gravityTicks(g.level) - g.fallTimer);
+    auto untilTick = lastTick + ticks * tickLen - clk::now();
+    int waitMs = max(0, (int)chrono::duration_cast<chrono::milliseconds>(untilTick + chrono::microseconds(999)).count());
+    int escMs = inputTimeout();
+    waitInput(escMs >= 0 ? min(waitMs, escMs) : waitMs);
 
 }
 
 // final screen
-drawGame(g);
-cout << "GAME OVER! Final Score: "<< g.score << "\n";
+stopRenderer(renderer);
+Frame last;
+drawGame(last, g);
+submitFrame(renderer.term, last);
+drainTerm(renderer.term);
+if(saved) cout << "Game saved to " << savePath << "; run again to continue.\n";
+else {
+    cout << "GAME OVER! Final Score: "<< g.score << "\n";
+    remove(savePath.c_str()); // a finished game is not resumed
+#ifndef _WIN32
+    const char *user = getenv("USER");
+    int rank = addScore(scores, makeScoreRecord(g, user ? user : "player"), steadyMs());
+    cout << "High scores:\n";
+    for(int i=0;i<(int)scores.top.size() && i<10;++i){
+        const ScoreRecord &r = scores.top[i];
+        cout << setw(3) << i+1 << ". " << setw(9) << r.score << "  L" << setw(2) << r.level << setw(5) << r.lines
+             << " lines  " << r.name << (i == rank ? "   <- this game" : "") << "\n";
+    }
+    if(rank >= 10) cout << setw(3) << rank+1 << ". " << setw(9) << g.score << "  (this game)\n";
+#endif
+}
+#ifndef _WIN32
+closeScores(scores);
+#endif
+metricAdd(MET_GAMES_FINISHED);
+if(!metricsPath.empty()) writeMetricsFile();
+dumpStats(chrono::duration<double>(clk::now() - startTime).count());
 showCursor();
 restoreTerminal();
 return 0;